@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "annotated_string.h"
+#include <limits>
+#include <map>
 #include "log.h"
 
 std::atomic<uint16_t> Site::id_gen_{1};
@@ -126,12 +128,38 @@ void AnnotatedString::Integrate(const Command& cmd) {
   }
 }
 
+bool AnnotatedString::Reflects(const Command& cmd) const {
+  const ID id(cmd.id());
+  switch (cmd.command_case()) {
+    case Command::kInsert:
+      return chars_.Lookup(id) != nullptr;
+    case Command::kDelete: {
+      const CharInfo* ci = chars_.Lookup(id);
+      return ci != nullptr && !ci->visible;
+    }
+    case Command::kDecl:
+      return attributes_.Lookup(id) != nullptr ||
+             graveyard_.Lookup(id);
+    case Command::kDelDecl:
+      return attributes_.Lookup(id) == nullptr;
+    case Command::kMark:
+      return annotations_.Lookup(id) != nullptr ||
+             graveyard_.Lookup(id);
+    case Command::kDelMark:
+      return annotations_.Lookup(id) == nullptr;
+    default:
+      return false;
+  }
+}
+
+// Character by character: an insert may repeat some of what's here already.
+// AsCommands merges a site's run of characters into one insert however many
+// it took to type them, so a peer replaying that may hold the run's start.
 void AnnotatedString::IntegrateInsert(ID id, const InsertCommand& cmd) {
-  if (chars_.Lookup(id)) return;
   ID after = cmd.after();
   ID before = cmd.before();
   for (auto c : cmd.characters()) {
-    IntegrateInsertChar(id, c, after, before);
+    if (!chars_.Lookup(id)) IntegrateInsertChar(id, c, after, before);
     after = id;
     id.clock++;
   }
@@ -339,6 +367,173 @@ AnnotatedStringMsg AnnotatedString::AsProto() const {
   return out;
 }
 
+void AnnotatedString::AsCommands(CommandSet* out) const {
+  AsCommandChunks(std::numeric_limits<size_t>::max(),
+                  [out](CommandSet* chunk) { out->MergeFrom(*chunk); });
+}
+
+namespace {
+
+// A set of ids, held as runs of consecutive clocks from one site: text is
+// mostly typed (and always loaded) in runs, so this stays far smaller than
+// the number of characters
+class IDRuns {
+ public:
+  bool Contains(ID id) const {
+    auto it = runs_.upper_bound(Key(id));
+    if (it == runs_.begin()) return false;
+    --it;
+    return it->first.first == Key(id).first && id.clock < it->second;
+  }
+
+  void Add(ID id) {
+    auto next = runs_.upper_bound(Key(id));
+    uint64_t end = id.clock + 1;
+    if (next != runs_.end() && next->first == Key(ID(id.site, end))) {
+      end = next->second;
+      next = runs_.erase(next);
+    }
+    if (next != runs_.begin()) {
+      auto prev = std::prev(next);
+      if (prev->first.first == Key(id).first && prev->second == id.clock) {
+        prev->second = end;
+        return;
+      }
+    }
+    runs_.emplace_hint(next, Key(id), end);
+  }
+
+ private:
+  typedef std::pair<uint16_t, uint64_t> SiteClock;
+  static SiteClock Key(ID id) {
+    return SiteClock(static_cast<uint16_t>(id.site),
+                     static_cast<uint64_t>(id.clock));
+  }
+  // first id -> one past the last clock
+  std::map<SiteClock, uint64_t> runs_;
+};
+
+}  // namespace
+
+void AnnotatedString::AsCommandChunks(
+    size_t max_bytes, const std::function<void(CommandSet*)>& chunk) const {
+  // allowance for a command's id and framing, over its payload
+  static constexpr size_t kCommandOverhead = 32;
+  CommandSet cur;
+  size_t cur_bytes = 0;
+  auto add_command = [&](size_t payload) -> Command* {
+    if (cur_bytes + payload + kCommandOverhead > max_bytes &&
+        cur.commands_size() > 0) {
+      chunk(&cur);
+      cur.Clear();
+      cur_bytes = 0;
+    }
+    cur_bytes += payload + kCommandOverhead;
+    return cur.add_commands();
+  };
+
+  // characters go out in document order, except that both neighbours each
+  // was inserted between must go out first; runs typed by one site are
+  // merged into one insert (split again at chunk boundaries, which
+  // integrates identically)
+  IDRuns emitted;
+  emitted.Add(Begin());
+  emitted.Add(End());
+  auto emit_run = [&](ID id, const CharInfo* ci) {
+    const ID before = ci->before;
+    ID after = ci->after;
+    while (ci) {
+      Command* cmd = add_command(0);
+      cmd->set_id(id.id);
+      auto* ins = cmd->mutable_insert();
+      ins->set_after(after.id);
+      ins->set_before(before.id);
+      std::vector<ID> deleted;
+      do {
+        ins->mutable_characters()->push_back(ci->chr);
+        cur_bytes++;
+        emitted.Add(id);
+        if (!ci->visible) deleted.push_back(id);
+        after = id;
+        id = ID(id.site, id.clock + 1);
+        ci = chars_.Lookup(id);
+        if (ci && (emitted.Contains(id) || ci->after != after ||
+                   ci->before != before)) {
+          ci = nullptr;
+        }
+      } while (ci && cur_bytes < max_bytes);
+      for (ID del : deleted) MakeDelete(&cur, del);
+      cur_bytes += deleted.size() * kCommandOverhead;
+    }
+  };
+  auto emit_with_deps = [&](ID id) {
+    std::vector<ID> stack{id};
+    while (!stack.empty()) {
+      const ID top = stack.back();
+      if (emitted.Contains(top)) {
+        stack.pop_back();
+        continue;
+      }
+      const CharInfo* ci = chars_.Lookup(top);
+      bool ready = true;
+      for (ID dep : {ci->after, ci->before}) {
+        if (!emitted.Contains(dep)) {
+          stack.push_back(dep);
+          ready = false;
+        }
+      }
+      if (ready) {
+        stack.pop_back();
+        emit_run(top, ci);
+      }
+    }
+  };
+  for (ID id = chars_.Lookup(Begin())->next; id != End();
+       id = chars_.Lookup(id)->next) {
+    emit_with_deps(id);
+  }
+
+  attributes_by_type_.ForEach(
+      [&](Attribute::DataCase, AVL<ID, Attribute> attrs) {
+        attrs.ForEach([&](ID id, const Attribute& attr) {
+          Command* cmd = add_command(attr.ByteSizeLong());
+          cmd->set_id(id.id);
+          *cmd->mutable_decl() = attr;
+        });
+      });
+  annotations_by_type_.ForEach(
+      [&](Attribute::DataCase, AVL<ID, Annotation> annos) {
+        annos.ForEach([&](ID id, const Annotation& anno) {
+          // marks of deleted attributes can't be integrated anywhere
+          if (!attributes_.Lookup(anno.attribute())) return;
+          Command* cmd = add_command(anno.ByteSizeLong());
+          cmd->set_id(id.id);
+          *cmd->mutable_mark() = anno;
+        });
+      });
+  // the graveyard doesn't record what each id was: only the matching delete
+  // has any effect
+  graveyard_.ForEach([&](ID id) {
+    add_command(0)->set_id(id.id);
+    cur.mutable_commands()->rbegin()->mutable_del_decl();
+    add_command(0)->set_id(id.id);
+    cur.mutable_commands()->rbegin()->mutable_del_mark();
+  });
+  if (cur.commands_size() > 0) chunk(&cur);
+}
+
+size_t AnnotatedString::ApproximateMemoryUsage() const {
+  // per node estimates: the node itself, its shared_ptr control block and
+  // (for attributes) a typical payload
+  static constexpr size_t kCharBytes = 128;
+  static constexpr size_t kLineBreakBytes = 80;
+  static constexpr size_t kAttributeBytes = 256;
+  static constexpr size_t kGraveBytes = 64;
+  return chars_.Size() * kCharBytes + line_breaks_.Size() * kLineBreakBytes +
+         (attributes_.Size() + annotations_.Size()) * kAttributeBytes +
+         graveyard_.Size() * kGraveBytes;
+}
+
 AnnotatedString AnnotatedString::FromProto(const AnnotatedStringMsg& msg) {
   AnnotatedString out;
   for (const auto& chr : msg.chars()) {
@@ -15,6 +15,7 @@
 
 #include <stdint.h>
 #include <atomic>
+#include <functional>
 #include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
 #include "avl.h"
@@ -92,11 +93,9 @@ class AnnotatedString {
 
   ID Insert(CommandSet* commands, Site* site, absl::string_view chars,
             ID after) {
-    const size_t start = commands->mutable_commands()->size();
+    const int start = commands->commands_size();
     ID r = MakeInsert(commands, site, chars, after);
-    for (size_t i = start; i < commands->mutable_commands()->size(); i++) {
-      Integrate(commands->mutable_commands()->Get(i));
-    }
+    IntegrateFrom(*commands, start);
     return r;
   }
 
@@ -113,6 +112,17 @@ class AnnotatedString {
       it.MoveNext();
     }
   }
+  // MakeDelete, integrating the commands made as Insert does
+  void Delete(CommandSet* commands, ID id) {
+    const int start = commands->commands_size();
+    MakeDelete(commands, id);
+    IntegrateFrom(*commands, start);
+  }
+  void Delete(CommandSet* commands, ID beg, ID end) {
+    const int start = commands->commands_size();
+    MakeDelete(commands, beg, end);
+    IntegrateFrom(*commands, start);
+  }
   static void MakeDelDecl(CommandSet* commands, ID id);
   static void MakeDelMark(CommandSet* commands, ID id);
   static ID MakeDecl(CommandSet* commands, Site* site,
@@ -124,6 +134,9 @@ class AnnotatedString {
 
   AnnotatedString Integrate(const CommandSet& commands) const;
   void Integrate(const Command& command);
+  // true if command has been integrated already (or its effect has: a
+  // deletion someone else made too)
+  bool Reflects(const Command& command) const;
 
   // return <0 if a before b, >0 if a after b, ==0 if a==b
   int OrderIDs(ID a, ID b) const;
@@ -140,6 +153,12 @@ class AnnotatedString {
     return chars_.SameIdentity(other.chars_);
   }
 
+  // true if other has the same lines (though perhaps not the same text on
+  // them)
+  bool SameLineIdentity(const AnnotatedString& other) const {
+    return line_breaks_.SameIdentity(other.line_breaks_);
+  }
+
   bool SameTotalIdentity(const AnnotatedString& other) const {
     return chars_.SameIdentity(other.chars_) &&
            attributes_by_type_.SameIdentity(other.attributes_by_type_) &&
@@ -171,7 +190,25 @@ class AnnotatedString {
   AnnotatedStringMsg AsProto() const;
   static AnnotatedString FromProto(const AnnotatedStringMsg& msg);
 
+  // commands that, integrated in order into any string sharing this one's
+  // history (including an empty one), bring it up to date with this one
+  void AsCommands(CommandSet* out) const;
+  // the same commands, starting from the top of the document and handed to
+  // chunk in sets of about max_bytes each as they are produced
+  void AsCommandChunks(size_t max_bytes,
+                       const std::function<void(CommandSet*)>& chunk) const;
+
+  // rough count of bytes held by this version alone (structure shared with
+  // other versions is counted in full by each of them)
+  size_t ApproximateMemoryUsage() const;
+
  private:
+  // integrate commands' commands from the start'th on
+  void IntegrateFrom(const CommandSet& commands, int start) {
+    for (int i = start; i < commands.commands_size(); i++) {
+      Integrate(commands.commands(i));
+    }
+  }
   void IntegrateInsert(ID id, const InsertCommand& cmd);
   void IntegrateDelChar(ID id);
   void IntegrateDecl(ID id, const Attribute& decl);
@@ -233,6 +270,13 @@ class AnnotatedString {
       cur_ = str_->chars_.Lookup(pos_);
     }
 
+    // true if other (perhaps over another version of the string) is at the
+    // same character, in the same state, with the same annotations on it
+    bool SameCharacter(const AllIterator& other) const {
+      return pos_ == other.pos_ && cur_->visible == other.cur_->visible &&
+             cur_->annotations.SameIdentity(other.cur_->annotations);
+    }
+
     AllIterator Next() {
       AllIterator i(*this);
       i.MoveNext();
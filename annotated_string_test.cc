@@ -0,0 +1,136 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "annotated_string.h"
+#include <gtest/gtest.h>
+
+TEST(AnnotatedStringTest, AsCommandsRecreates) {
+  Site a, b;
+  AnnotatedString str;
+  ID end_of_first = str.Insert(&a, "hello world\n", AnnotatedString::Begin());
+  AnnotatedString before_edits = str;
+  str.Insert(&b, "again\n", end_of_first);
+  CommandSet del;
+  str.MakeDelete(&del,
+                 AnnotatedString::Iterator(str, AnnotatedString::Begin())
+                     .Next()
+                     .id());
+  str = str.Integrate(del);
+
+  CommandSet commands;
+  str.AsCommands(&commands);
+  EXPECT_EQ("ello world\nagain\n",
+            AnnotatedString().Integrate(commands).Render());
+  EXPECT_EQ(str.Render(), before_edits.Integrate(commands).Render());
+}
+
+TEST(AnnotatedStringTest, AsCommandChunksBounded) {
+  Site site;
+  AnnotatedString str;
+  ID last = AnnotatedString::Begin();
+  for (int i = 0; i < 100; i++) {
+    last = str.Insert(&site, "a line of text\n", last);
+  }
+  AnnotatedString rebuilt;
+  int chunks = 0;
+  str.AsCommandChunks(256, [&](CommandSet* chunk) {
+    EXPECT_LE(chunk->ByteSizeLong(), 256);
+    rebuilt = rebuilt.Integrate(*chunk);
+    chunks++;
+  });
+  EXPECT_GT(chunks, 1);
+  EXPECT_EQ(str.Render(), rebuilt.Render());
+}
+
+TEST(AnnotatedStringTest, AsCommandsInterleavedSites) {
+  Site a, b;
+  AnnotatedString str;
+  ID last = str.Insert(&a, "0123456789", AnnotatedString::Begin());
+  // each insert lands between characters the other site typed
+  for (int i = 0; i < 20; i++) {
+    AnnotatedString::Iterator it(str, AnnotatedString::Begin());
+    for (int j = 0; j < 2 * i + 1; j++) it.MoveNext();
+    last = str.Insert(i % 2 ? &a : &b, "xy", it.id());
+  }
+  CommandSet commands;
+  str.AsCommands(&commands);
+  EXPECT_EQ(str.Render(), AnnotatedString().Integrate(commands).Render());
+}
+
+TEST(AnnotatedStringTest, AsCommandsCompletesPartOfARun) {
+  Site site;
+  AnnotatedString str;
+  ID last = str.Insert(&site, "abcde", AnnotatedString::Begin());
+  AnnotatedString peer = str;
+  // typed separately, but sent as one run with the first part
+  str.Insert(&site, "fgh", last);
+  CommandSet commands;
+  str.AsCommands(&commands);
+  ASSERT_EQ(1, commands.commands_size());
+  EXPECT_EQ("abcdefgh", peer.Integrate(commands).Render());
+}
+
+// a resumed client the server lacks history for gets the whole state again,
+// in chunks, on top of what it has
+TEST(AnnotatedStringTest, AsCommandChunksResumeHoldingPartOfARun) {
+  Site a, b;
+  AnnotatedString str;
+  ID last = AnnotatedString::Begin();
+  for (int i = 0; i < 10; i++) last = str.Insert(&a, "line\n", last);
+  AnnotatedString client = str;
+  for (int i = 0; i < 10; i++) last = str.Insert(&a, "more\n", last);
+  str.Insert(&b, "other\n", AnnotatedString::Begin());
+  CommandSet del;
+  str.MakeDelete(&del,
+                 AnnotatedString::Iterator(str, AnnotatedString::Begin())
+                     .Next()
+                     .id());
+  str = str.Integrate(del);
+  int chunks = 0;
+  str.AsCommandChunks(64, [&](CommandSet* chunk) {
+    client = client.Integrate(*chunk);
+    chunks++;
+  });
+  EXPECT_GT(chunks, 1);
+  EXPECT_EQ(str.Render(), client.Render());
+}
+
+TEST(AnnotatedStringTest, Reflects) {
+  Site site;
+  AnnotatedString str;
+  CommandSet insert;
+  ID c = str.MakeInsert(&insert, &site, "c", AnnotatedString::Begin());
+  EXPECT_FALSE(str.Reflects(insert.commands(0)));
+  str = str.Integrate(insert);
+  EXPECT_TRUE(str.Reflects(insert.commands(0)));
+
+  CommandSet del;
+  AnnotatedString::MakeDelete(&del, c);
+  EXPECT_FALSE(str.Reflects(del.commands(0)));
+  str = str.Integrate(del);
+  EXPECT_TRUE(str.Reflects(del.commands(0)));
+
+  CommandSet decl;
+  Attribute attr;
+  attr.mutable_tags()->add_tags("tag");
+  ID id = AnnotatedString::MakeDecl(&decl, &site, attr);
+  EXPECT_FALSE(str.Reflects(decl.commands(0)));
+  str = str.Integrate(decl);
+  EXPECT_TRUE(str.Reflects(decl.commands(0)));
+  CommandSet del_decl;
+  AnnotatedString::MakeDelDecl(&del_decl, id);
+  EXPECT_FALSE(str.Reflects(del_decl.commands(0)));
+  str = str.Integrate(del_decl);
+  EXPECT_TRUE(str.Reflects(del_decl.commands(0)));
+  EXPECT_TRUE(str.Reflects(decl.commands(0)));
+}
@@ -0,0 +1,354 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <city.h>
+#include <gflags/gflags.h>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "buffer.h"
+#include "clang_config.h"
+#include "log.h"
+#include "project.h"
+#include "proto/snapshot.pb.h"
+
+DEFINE_bool(annotation_cache, true,
+            "Show a file's annotations from the last time the same text was "
+            "open while collaborators recompute them");
+DEFINE_int64(annotation_cache_max_mb, 256,
+             "Size the project's annotation cache is trimmed to, dropping "
+             "the least recently used entries first");
+
+namespace {
+
+// attributes describing the text, rather than who is editing it
+bool Cacheable(Attribute::DataCase type) {
+  switch (type) {
+    case Attribute::DATA_NOT_SET:
+    case Attribute::kCursor:
+    case Attribute::kSelection:
+    case Attribute::kFind:
+    case Attribute::kFindMatch:
+      return false;
+    default:
+      return true;
+  }
+}
+
+// the type of attribute one of this type refers to by id, if any: the two
+// are replayed and retracted together
+Attribute::DataCase Referent(Attribute::DataCase type) {
+  switch (type) {
+    case Attribute::kFixit:
+      return Attribute::kDiagnostic;
+    case Attribute::kBufferRef:
+      return Attribute::kBuffer;
+    default:
+      return Attribute::DATA_NOT_SET;
+  }
+}
+
+// the positions AnnotationCache.Mark refers to
+std::vector<ID> Positions(const AnnotatedString& content) {
+  std::vector<ID> positions;
+  AnnotatedString::Iterator it(content, AnnotatedString::Begin());
+  positions.push_back(it.id());
+  while (!it.is_end()) {
+    it.MoveNext();
+    positions.push_back(it.id());
+  }
+  return positions;
+}
+
+bool IsCFamily(const boost::filesystem::path& filename) {
+  auto fext = filename.extension();
+  for (auto mext :
+       {".c", ".cxx", ".cpp", ".C", ".cc", ".h", ".H", ".hpp", ".hxx"}) {
+    if (fext == mext) return true;
+  }
+  return false;
+}
+
+}  // namespace
+
+// Keeps the attributes a buffer's collaborators produced, as of when it
+// closes, keyed by its text and the arguments it compiles with. The next
+// time that text is opened they're replayed at once (under a site of our
+// own), and each type is retracted as soon as a collaborator produces fresh
+// attributes of it.
+class AnnotationCacheCollaborator final : public SyncCollaborator {
+ public:
+  AnnotationCacheCollaborator(const Buffer* buffer)
+      : SyncCollaborator("annotation_cache", absl::Seconds(0),
+                         absl::Seconds(0)),
+        buffer_(buffer) {}
+
+  EditResponse Edit(const EditNotification& notification) override {
+    EditResponse response;
+    response.done = notification.shutdown;
+    if (response.done) {
+      if (loaded_) Save(notification.content);
+      return response;
+    }
+    if (!notification.fully_loaded) return response;
+    if (!loaded_) {
+      loaded_ = true;
+      if (IsCFamily(buffer_->filename())) {
+        std::vector<std::string> args;
+        ClangCompileArgs(buffer_->project(), buffer_->filename(), &args);
+        compile_args_ = absl::StrJoin(args, " ");
+      }
+      Replay(notification.content, &response.content_updates);
+    } else {
+      Retract(notification.content, &response.content_updates);
+    }
+    return response;
+  }
+
+ private:
+  boost::filesystem::path CacheDir() const {
+    return buffer_->project()->aspect<ProjectRoot>()->Path() / ".cedcache";
+  }
+
+  // where the entry for content goes, and the hash of its text it records
+  std::pair<boost::filesystem::path, uint64_t> CacheKey(
+      const AnnotatedString& content) const {
+    const std::string text = content.Render();
+    const std::string key =
+        absl::StrCat(text, std::string(1, '\0'), compile_args_);
+    const uint128 name = CityHash128(key.data(), key.size());
+    return std::make_pair(
+        CacheDir() / absl::StrCat(absl::Hex(Uint128High64(name),
+                                            absl::kZeroPad16),
+                                  absl::Hex(Uint128Low64(name),
+                                            absl::kZeroPad16),
+                                  ".annotations"),
+        CityHash64(text.data(), text.size()));
+  }
+
+  void Replay(const AnnotatedString& content, CommandSet* commands) {
+    uint64_t text_hash;
+    std::tie(loaded_path_, text_hash) = CacheKey(content);
+    AnnotationCache cache;
+    {
+      std::ifstream in(loaded_path_.string(), std::ios::binary);
+      if (!in || !cache.ParseFromIstream(&in)) return;
+    }
+    const auto positions = Positions(content);
+    if (cache.characters() + 2 != positions.size() ||
+        cache.text_hash() != text_hash ||
+        cache.compile_args() != compile_args_) {
+      Log() << "Annotation cache entry " << loaded_path_
+            << " doesn't match " << buffer_->filename();
+      return;
+    }
+    // recently used: see Trim
+    boost::system::error_code ec;
+    boost::filesystem::last_write_time(loaded_path_, std::time(nullptr), ec);
+
+    // cached attribute id -> replayed one; referents first, so references
+    // to them can be rewritten
+    std::unordered_map<uint64_t, ID> ids;
+    for (bool references : {false, true}) {
+      for (auto& a : *cache.mutable_attributes()) {
+        Attribute* attr = a.mutable_attr();
+        const auto type = attr->data_case();
+        if ((Referent(type) != Attribute::DATA_NOT_SET) != references) {
+          continue;
+        }
+        if (type == Attribute::kFixit) {
+          auto it = ids.find(attr->fixit().diagnostic());
+          if (it == ids.end()) continue;
+          attr->mutable_fixit()->set_diagnostic(it->second.id);
+        } else if (type == Attribute::kBufferRef) {
+          auto it = ids.find(attr->buffer_ref().buffer());
+          if (it == ids.end()) continue;
+          attr->mutable_buffer_ref()->set_buffer(it->second.id);
+        }
+        ids[a.id()] = AnnotatedString::MakeDecl(commands, &site_, *attr);
+        replayed_.insert(type);
+      }
+    }
+    for (const auto& m : cache.marks()) {
+      auto it = ids.find(m.attribute());
+      if (it == ids.end() || m.begin() >= positions.size() ||
+          m.end() >= positions.size()) {
+        continue;
+      }
+      Annotation anno;
+      anno.set_begin(positions[m.begin()].id);
+      anno.set_end(positions[m.end()].id);
+      anno.set_attribute(it->second.id);
+      AnnotatedString::MakeMark(commands, &site_, anno);
+    }
+    Log() << "Replayed " << ids.size() << " cached attributes and "
+          << cache.marks_size() << " marks on " << buffer_->filename();
+  }
+
+  void Retract(const AnnotatedString& content, CommandSet* commands) {
+    if (replayed_.empty()) return;
+    std::set<Attribute::DataCase> fresh;
+    for (auto type : replayed_) {
+      bool found = false;
+      content.ForEachAttribute(type, [&](ID id, const Attribute& attr) {
+        if (!site_.CreatedID(id)) found = true;
+      });
+      if (found) fresh.insert(type);
+    }
+    for (auto type : replayed_) {
+      const auto referent = Referent(type);
+      if (fresh.count(type) || fresh.count(referent)) {
+        fresh.insert(type);
+        fresh.insert(referent);
+      }
+    }
+    for (auto type : fresh) {
+      if (replayed_.erase(type) == 0) continue;
+      content.ForEachAnnotation(
+          type, [&](ID id, ID begin, ID end, const Attribute& attr) {
+            if (site_.CreatedID(id)) {
+              AnnotatedString::MakeDelMark(commands, id);
+            }
+          });
+      content.ForEachAttribute(type, [&](ID id, const Attribute& attr) {
+        if (site_.CreatedID(id)) AnnotatedString::MakeDelDecl(commands, id);
+      });
+    }
+  }
+
+  void Save(const AnnotatedString& content) {
+    const auto positions = Positions(content);
+    std::unordered_map<uint64_t, uint64_t> position_of;
+    for (size_t i = 0; i < positions.size(); i++) {
+      position_of[positions[i].id] = i;
+    }
+    const Site* ours = buffer_->site();
+    const auto key = CacheKey(content);
+    AnnotationCache cache;
+    cache.set_compile_args(compile_args_);
+    cache.set_text_hash(key.second);
+    cache.set_characters(positions.size() - 2);
+    // marks only carry their attribute's value: find its id by that
+    std::unordered_map<std::string, uint64_t> attr_ids;
+    const auto* data = Attribute::descriptor()->FindOneofByName("data");
+    for (int i = 0; i < data->field_count(); i++) {
+      const auto type =
+          static_cast<Attribute::DataCase>(data->field(i)->number());
+      if (!Cacheable(type)) continue;
+      content.ForEachAttribute(type, [&](ID id, const Attribute& attr) {
+        if (!ours->CreatedID(id)) return;
+        auto* a = cache.add_attributes();
+        a->set_id(id.id);
+        *a->mutable_attr() = attr;
+        attr_ids.emplace(attr.SerializeAsString(), id.id);
+      });
+      content.ForEachAnnotation(
+          type, [&](ID id, ID begin, ID end, const Attribute& attr) {
+            if (!ours->CreatedID(id)) return;
+            auto attr_id = attr_ids.find(attr.SerializeAsString());
+            auto b = position_of.find(begin.id);
+            auto e = position_of.find(end.id);
+            if (attr_id == attr_ids.end() || b == position_of.end() ||
+                e == position_of.end()) {
+              return;
+            }
+            auto* m = cache.add_marks();
+            m->set_begin(b->second);
+            m->set_end(e->second);
+            m->set_attribute(attr_id->second);
+          });
+    }
+    if (cache.attributes().empty()) return;
+
+    const auto& path = key.first;
+    const auto tmp_path = path.string() + ".tmp";
+    // runs on a collaborator thread, which nothing would catch a throw on
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(CacheDir(), ec);
+    if (ec) {
+      Log() << "Failed creating annotation cache " << CacheDir() << ": "
+            << ec.message();
+      return;
+    }
+    {
+      std::ofstream out(tmp_path, std::ios::binary);
+      if (!cache.SerializeToOstream(&out)) {
+        Log() << "Failed writing annotation cache for " << buffer_->filename();
+        return;
+      }
+    }
+    boost::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+      Log() << "Failed writing annotation cache entry " << path << ": "
+            << ec.message();
+      boost::filesystem::remove(tmp_path, ec);
+      return;
+    }
+    // the text we opened has changed: nobody will open it again soon
+    if (!loaded_path_.empty() && loaded_path_ != path) {
+      boost::filesystem::remove(loaded_path_, ec);
+      if (ec) {
+        Log() << "Failed removing annotation cache entry " << loaded_path_
+              << ": " << ec.message();
+      }
+    }
+    Trim();
+  }
+
+  // remove the least recently written (or replayed) entries until the
+  // cache fits annotation_cache_max_mb
+  void Trim() {
+    std::vector<std::tuple<std::time_t, uintmax_t, boost::filesystem::path>>
+        entries;
+    uintmax_t total = 0;
+    boost::system::error_code ec;
+    for (boost::filesystem::directory_iterator it(CacheDir(), ec), end;
+         !ec && it != end; it.increment(ec)) {
+      const auto& path = it->path();
+      if (path.extension() != ".annotations") continue;
+      const uintmax_t size = boost::filesystem::file_size(path, ec);
+      const std::time_t time = boost::filesystem::last_write_time(path, ec);
+      if (ec) continue;
+      entries.emplace_back(time, size, path);
+      total += size;
+    }
+    const uintmax_t max_bytes =
+        static_cast<uintmax_t>(FLAGS_annotation_cache_max_mb) << 20;
+    std::sort(entries.begin(), entries.end());
+    for (const auto& e : entries) {
+      if (total <= max_bytes) break;
+      boost::filesystem::remove(std::get<2>(e), ec);
+      total -= std::get<1>(e);
+    }
+  }
+
+  const Buffer* const buffer_;
+  // marks replayed from the cache are ours, so collaborators' are told apart
+  Site site_;
+  bool loaded_ = false;
+  std::string compile_args_;
+  boost::filesystem::path loaded_path_;
+  // types of attribute replayed and not yet retracted
+  std::set<Attribute::DataCase> replayed_;
+};
+
+LAZY_SERVER_COLLABORATOR(AnnotationCacheCollaborator, kStartOnLoaded,
+                         buffer) {
+  return FLAGS_annotation_cache && !buffer->synthetic();
+}
@@ -36,6 +36,7 @@ class AVL {
   }
 
   bool Empty() const { return root_ == nullptr; }
+  size_t Size() const { return Size(root_); }
 
   template <class F>
   void ForEach(F &&f) const {
@@ -52,11 +53,13 @@ class AVL {
         : kv(std::move(k), std::move(v)),
           left(std::move(l)),
           right(std::move(r)),
-          height(h) {}
+          height(h),
+          size(1 + Size(left) + Size(right)) {}
     const std::pair<K, V> kv;
     const NodePtr left;
     const NodePtr right;
     const long height;
+    const size_t size;
   };
   NodePtr root_;
 
@@ -71,6 +74,7 @@ class AVL {
   }
 
   static long Height(const NodePtr &n) { return n ? n->height : 0; }
+  static size_t Size(const NodePtr &n) { return n ? n->size : 0; }
 
   static NodePtr MakeNode(K key, V value, const NodePtr &left,
                           const NodePtr &right) {
@@ -228,6 +232,7 @@ class AVL<K, void> {
   AVL Remove(const K &key) const { return AVL(RemoveKey(root_, key)); }
   bool Lookup(const K &key) const { return Get(root_, key) != nullptr; }
   bool Empty() const { return root_ == nullptr; }
+  size_t Size() const { return Size(root_); }
 
   template <class F>
   void ForEach(F &&f) const {
@@ -244,11 +249,13 @@ class AVL<K, void> {
         : key(std::move(k)),
           left(std::move(l)),
           right(std::move(r)),
-          height(h) {}
+          height(h),
+          size(1 + Size(left) + Size(right)) {}
     const K key;
     const NodePtr left;
     const NodePtr right;
     const long height;
+    const size_t size;
   };
   NodePtr root_;
 
@@ -263,6 +270,7 @@ class AVL<K, void> {
   }
 
   static long Height(const NodePtr &n) { return n ? n->height : 0; }
+  static size_t Size(const NodePtr &n) { return n ? n->size : 0; }
 
   static NodePtr MakeNode(K key, const NodePtr &left, const NodePtr &right) {
     return std::make_shared<Node>(std::move(key), left, right,
@@ -21,3 +21,16 @@ TEST(AvlTest, Lookup) {
   EXPECT_EQ(nullptr, avl.Lookup(2));
   EXPECT_EQ(42, *avl.Lookup(1));
 }
+
+TEST(AvlTest, Size) {
+  AVL<int, int> avl;
+  EXPECT_EQ(0, avl.Size());
+  for (int i = 0; i < 100; i++) avl = avl.Add(i, i);
+  EXPECT_EQ(100, avl.Size());
+  avl = avl.Add(50, 0);
+  EXPECT_EQ(100, avl.Size());
+  for (int i = 0; i < 100; i += 2) avl = avl.Remove(i);
+  EXPECT_EQ(50, avl.Size());
+  AVL<int> set = AVL<int>().Add(3).Add(1).Add(2);
+  EXPECT_EQ(3, set.Size());
+}
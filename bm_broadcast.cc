@@ -0,0 +1,92 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include "broadcast.h"
+
+DECLARE_int64(listener_batch_linger_us);
+
+// a burst of annotations, as a collaborator might publish
+static CommandSet MakeUpdate(Site* site) {
+  CommandSet commands;
+  for (int i = 0; i < 64; i++) {
+    Attribute attr;
+    attr.mutable_tags()->add_tags(std::string(64, 'a' + i % 26));
+    AnnotatedString::MakeDecl(&commands, site, attr);
+  }
+  return commands;
+}
+
+// Publishes an update to state.range(0) listeners per iteration, each of
+// which encodes what it receives as the message its stream would be sent.
+template <class Encode>
+static void Broadcast(benchmark::State& state, Encode encode) {
+  FLAGS_listener_batch_linger_us = 0;
+  auto buffer = Buffer::Builder().SetFilename("x.txt").SetSynthetic().Make();
+  const int subscribers = state.range(0);
+  absl::Mutex mu;
+  int64_t delivered = 0;
+  std::vector<std::unique_ptr<BufferListener>> listeners;
+  for (int i = 0; i < subscribers; i++) {
+    listeners.push_back(buffer->ListenVersioned(
+        nullptr,
+        [](const AnnotatedString&, const CommandSet*, const VersionVector&) {},
+        [&](const PublishedUpdates& updates, const VersionVector& version) {
+          auto msg = encode(updates, version);
+          benchmark::DoNotOptimize(msg);
+          absl::MutexLock lock(&mu);
+          delivered += updates.size();
+        },
+        []() { abort(); }));
+  }
+
+  Site site;
+  int64_t published = 0;
+  int64_t bytes = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    CommandSet commands = MakeUpdate(&site);
+    bytes += commands.ByteSizeLong();
+    state.ResumeTiming();
+    buffer->PushChanges(&commands, false);
+    published++;
+    absl::MutexLock lock(&mu);
+    auto all_delivered = [&]() { return delivered == published * subscribers; };
+    mu.Await(absl::Condition(&all_delivered));
+  }
+  state.SetBytesProcessed(bytes * subscribers);
+}
+
+// what each stream did before updates were shared: copy them into a message
+// of its own and serialize it
+static void BM_BroadcastCopying(benchmark::State& state) {
+  Broadcast(state,
+            [](const PublishedUpdates& updates, const VersionVector& version) {
+              EditMessage msg;
+              MergeUpdates(updates, msg.mutable_commands());
+              *msg.mutable_version() = VersionVectorToProto(version);
+              return msg.SerializeAsString();
+            });
+}
+BENCHMARK(BM_BroadcastCopying)->Arg(1)->Arg(8)->Arg(64)->UseRealTime();
+
+static void BM_BroadcastShared(benchmark::State& state) {
+  Broadcast(state,
+            [](const PublishedUpdates& updates, const VersionVector& version) {
+              return EditMessageBuffer(updates, version);
+            });
+}
+BENCHMARK(BM_BroadcastShared)->Arg(1)->Arg(8)->Arg(64)->UseRealTime();
+
+BENCHMARK_MAIN();
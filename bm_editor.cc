@@ -14,28 +14,6 @@
 #include <benchmark/benchmark.h>
 #include "editor.h"
 
-struct MockColor {
-  int Theme(const Tag& tag, uint32_t flags) {
-    theme_calls[std::make_pair(tag, flags)]++;
-    return 0;
-  }
-
-  std::map<std::pair<Tag, uint32_t>, int> theme_calls;
-};
-
-struct MockContext {
-  const Renderer<MockContext>::Rect* window;
-  MockColor* color;
-  bool animating;
-  int* moves;
-  int* putc;
-  int* puts;
-
-  void Move(int row, int col) { (*moves)++; }
-  void Put(int row, int col, char c, int attr) { (*putc)++; }
-  void Put(int row, int col, const std::string& s, int attr) { (*puts)++; }
-};
-
 static std::string GenLines(const std::string& base, int n) {
   std::string out;
   for (int i = 0; i < n; i++) {
@@ -45,75 +23,67 @@ static std::string GenLines(const std::string& base, int n) {
   return out;
 }
 
-static void BM_EditorRender(benchmark::State& state) {
-  Site site;
-  Editor editor(&site);
-  MockColor color;
-  int moves = 0;
-  int putc = 0;
-  int puts = 0;
-  Renderer<MockContext>::Rect win(lay_vec4{0, 0, 200, 100});
-
+static std::shared_ptr<Editor> MakeEditor(Site* site, int lines) {
+  auto editor = Editor::Make(site, "bm_editor", true);
   EditNotification n;
-  EditResponse r;
-  String::MakeRawInsert(&r.content, &site,
-                        "int foo(int i) {\n" +
-                            GenLines("i += 123456789;", state.range(0)) + "}\n",
-                        String::Begin(), String::End());
-  IntegrateResponse(r, &n);
-  editor.UpdateState(n);
+  n.content.Insert(site, GenLines("i += 123456789;", lines),
+                   AnnotatedString::Begin());
+  LogTimer tmr("bm_editor_load");
+  editor->UpdateState(&tmr, n);
+  return editor;
+}
 
+// walks the file from top to bottom n lines at a time, starting over when
+// it gets there
+static void MoveDown(benchmark::State& state, int n) {
+  Site site;
+  const int lines = state.range(0);
+  auto editor = MakeEditor(&site, lines);
+  int line = 0;
   for (auto _ : state) {
-    MockContext ctx{&win, &color, false, &moves, &putc, &puts};
-    editor.Render(&ctx);
+    if (line + n >= lines) {
+      editor->GoToLine(0);
+      line = 0;
+    }
+    editor->MoveDownN(n);
+    line += n;
   }
-
-  state.counters["moves"] = moves;
-  state.counters["putc"] = putc;
-  state.counters["puts"] = puts;
 }
-BENCHMARK(BM_EditorRender)->Range(1, 32768);
 
-static void BM_EditorRenderSideBar(benchmark::State& state) {
-  Site site;
-  Editor editor(&site);
-  MockColor color;
-  int moves = 0;
-  int putc = 0;
-  int puts = 0;
-  Renderer<MockContext>::Rect win(lay_vec4{0, 0, 200, 100});
+static void BM_EditorMoveDown(benchmark::State& state) { MoveDown(state, 1); }
+BENCHMARK(BM_EditorMoveDown)->RangeMultiplier(32)->Range(1, 1 << 20);
 
-  EditResponse r;
-  EditNotification n;
-  SideBuffer sb;
-  for (auto c : GenLines("i += 123456789;", state.range(0))) {
-    sb.content.push_back(c);
-    sb.tokens.push_back(Tag());
-  }
-  sb.CalcLines();
-  UMap<std::string, SideBuffer>::MakeInsert(&r.side_buffers, &site, "disasm",
-                                            sb);
-  AnnotationMap<SideBufferRef>::MakeInsert(
-      &r.side_buffer_refs, &site, String::Begin(),
-      Annotation<SideBufferRef>(String::End(),
-                                SideBufferRef{"disasm", {1, 2, 3, 4, 5, 6}}));
-  IntegrateResponse(r, &n);
-  editor.UpdateState(n);
+static void BM_EditorMovePageDown(benchmark::State& state) {
+  MoveDown(state, 50);
+}
+BENCHMARK(BM_EditorMovePageDown)->RangeMultiplier(32)->Range(64, 1 << 20);
 
-  {
-    MockContext ctx{&win, &color, false, &moves, &putc, &puts};
-    editor.Render(&ctx);
+static void BM_EditorGoToLine(benchmark::State& state) {
+  Site site;
+  const int lines = state.range(0);
+  auto editor = MakeEditor(&site, lines);
+  int line = 0;
+  for (auto _ : state) {
+    // stride through the file so consecutive jumps land far apart
+    line = (line + 7919) % lines;
+    editor->GoToLine(line);
   }
+}
+BENCHMARK(BM_EditorGoToLine)->RangeMultiplier(32)->Range(1, 1 << 20);
 
+// one keystroke typed at state.range(0) cursors, down to the response
+// carrying it to collaborators
+static void BM_EditorTypeMultiCursor(benchmark::State& state) {
+  Site site;
+  const int cursors = state.range(0);
+  auto editor = MakeEditor(&site, 2 * cursors);
+  for (int i = 1; i < cursors; i++) editor->AddCursorBelow();
+  editor->MakeResponse();
   for (auto _ : state) {
-    MockContext ctx{&win, &color, false, &moves, &putc, &puts};
-    editor.RenderSideBar(&ctx);
+    editor->InsChar('x');
+    benchmark::DoNotOptimize(editor->MakeResponse());
   }
-
-  state.counters["moves"] = moves;
-  state.counters["putc"] = putc;
-  state.counters["puts"] = puts;
 }
-BENCHMARK(BM_EditorRenderSideBar)->Range(1, 32768);
+BENCHMARK(BM_EditorTypeMultiCursor)->RangeMultiplier(8)->Range(1, 512);
 
-BENCHMARK_MAIN()
+BENCHMARK_MAIN();
@@ -0,0 +1,93 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "broadcast.h"
+#include <google/protobuf/io/coded_stream.h>
+#include <grpc/slice.h>
+#include <vector>
+
+namespace {
+
+// a slice over bytes kept alive by owner, which it takes
+template <class T>
+grpc::Slice SliceOwning(const void* bytes, size_t length, T* owner) {
+  return grpc::Slice(
+      grpc_slice_new_with_user_data(const_cast<void*>(bytes), length,
+                                    [](void* p) { delete static_cast<T*>(p); },
+                                    owner),
+      grpc::Slice::STEAL_REF);
+}
+
+grpc::Slice SliceOf(std::string* s) {
+  std::string* owned = new std::string;
+  owned->swap(*s);
+  return SliceOwning(owned->data(), owned->size(), owned);
+}
+
+// append a commands field holding payload (a serialized CommandSet, kept
+// alive by owner, which this takes) to slices
+template <class T>
+void AppendCommands(const std::string& payload, T* owner,
+                    std::vector<grpc::Slice>* slices) {
+  using google::protobuf::io::CodedOutputStream;
+  // a length delimited field
+  const uint32_t commands_tag = (EditMessage::kCommandsFieldNumber << 3) | 2;
+  // two varint32s
+  uint8_t header[10];
+  uint8_t* end = CodedOutputStream::WriteVarint32ToArray(commands_tag, header);
+  end = CodedOutputStream::WriteVarint32ToArray(payload.size(), end);
+  slices->emplace_back(
+      grpc_slice_from_copied_buffer(reinterpret_cast<const char*>(header),
+                                    end - header),
+      grpc::Slice::STEAL_REF);
+  slices->push_back(SliceOwning(payload.data(), payload.size(), owner));
+}
+
+grpc::ByteBuffer WithVersion(const VersionVector& version,
+                             std::vector<grpc::Slice>* slices) {
+  EditMessage trailer;
+  *trailer.mutable_version() = VersionVectorToProto(version);
+  std::string serialized_trailer = trailer.SerializeAsString();
+  slices->push_back(SliceOf(&serialized_trailer));
+  return grpc::ByteBuffer(slices->data(), slices->size());
+}
+
+}  // namespace
+
+grpc::ByteBuffer EditMessageBuffer(const PublishedUpdates& updates,
+                                   const VersionVector& version) {
+  std::vector<grpc::Slice> slices;
+  slices.reserve(2 * updates.size() + 1);
+  for (const auto& update : updates) {
+    AppendCommands(update->Serialized(),
+                   new std::shared_ptr<const PublishedUpdate>(update), &slices);
+  }
+  return WithVersion(version, &slices);
+}
+
+grpc::ByteBuffer EditMessageBuffer(
+    const std::shared_ptr<const std::string>& serialized_commands,
+    const VersionVector& version) {
+  std::vector<grpc::Slice> slices;
+  AppendCommands(*serialized_commands,
+                 new std::shared_ptr<const std::string>(serialized_commands),
+                 &slices);
+  return WithVersion(version, &slices);
+}
+
+grpc::ByteBuffer EditMessageBuffer(EditMessage* msg) {
+  std::string serialized = msg->SerializeAsString();
+  msg->Clear();
+  grpc::Slice slice = SliceOf(&serialized);
+  return grpc::ByteBuffer(&slice, 1);
+}
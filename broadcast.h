@@ -0,0 +1,38 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <grpc++/support/byte_buffer.h>
+#include "buffer.h"
+#include "proto/project_service.pb.h"
+
+// EditMessages built directly as gRPC byte buffers, for streams that write
+// pre-serialized responses.
+
+// A commands message carrying updates, then version. Each update's
+// serialized commands are shared, not copied, so the cost of serializing
+// one is paid once however many streams it's broadcast to. This relies on
+// protobuf merging repeated occurrences of a message field: the framed
+// updates parse as a single CommandSet.
+grpc::ByteBuffer EditMessageBuffer(const PublishedUpdates& updates,
+                                   const VersionVector& version);
+
+// A commands message carrying an already serialized CommandSet (shared, not
+// copied), then version.
+grpc::ByteBuffer EditMessageBuffer(
+    const std::shared_ptr<const std::string>& serialized_commands,
+    const VersionVector& version);
+
+// msg serialized (its contents are consumed)
+grpc::ByteBuffer EditMessageBuffer(EditMessage* msg);
@@ -12,13 +12,71 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "buffer.h"
+#include <gflags/gflags.h>
+#include <algorithm>
+#include <random>
 #include <unordered_map>
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
+#include "executor.h"
 #include "log.h"
 
+DEFINE_int64(listener_max_queued_bytes, 64 << 20,
+             "Disconnect a buffer listener once this many bytes of updates "
+             "are waiting to be delivered to it");
+DEFINE_int64(listener_batch_linger_us, 2000,
+             "How long a buffer listener holds non-interactive updates "
+             "(annotations, cursor moves) waiting for more to batch with");
+DEFINE_int32(listener_delivery_threads, 8,
+             "Threads shared by all buffer listeners to deliver updates; a "
+             "listener whose delivery blocks holds one until it returns");
+DEFINE_int64(buffer_command_log_bytes, 16 << 20,
+             "History each server side buffer keeps for resuming dropped "
+             "edit sessions; older sessions get a full snapshot instead");
+
 namespace {
 
+uint64_t MicrosSince(absl::Time start) {
+  return absl::ToInt64Microseconds(absl::Now() - start);
+}
+
+uint64_t NewEpoch() {
+  std::random_device rd;
+  return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+}
+
+Executor* DeliveryPool() {
+  // never destroyed: listeners may outlive static destruction
+  static Executor* pool =
+      new Executor("listener_delivery", FLAGS_listener_delivery_threads);
+  return pool;
+}
+
+Executor* DisconnectPool() {
+  // apart from delivery: a listener that overflowed is often one whose
+  // delivery is stuck, and every delivery thread may be stuck with it
+  static Executor* pool = new Executor("listener_disconnect", 1);
+  return pool;
+}
+
+// a listener stops lingering once this much is batched
+constexpr size_t kMaxBatchBytes = 64 << 10;
+
+// edits to content are what a user is waiting to see: they're delivered
+// immediately, while annotation traffic may be batched
+bool IsInteractive(const CommandSet& commands) {
+  for (const auto& cmd : commands.commands()) {
+    switch (cmd.command_case()) {
+      case Command::kInsert:
+      case Command::kDelete:
+        return true;
+      default:
+        break;
+    }
+  }
+  return false;
+}
+
 class CollaboratorRegistry {
  public:
   static CollaboratorRegistry& Get() {
@@ -26,44 +84,84 @@ class CollaboratorRegistry {
     return r;
   }
 
-  void Register(std::function<void(Buffer*)> f) { collabs_.push_back(f); }
+  // implicitly part of every collaborator's start conditions, so that the
+  // ones with none start once the buffer has been created
+  static constexpr unsigned kCreated = 1u << 31;
 
-  void Run(Buffer* buffer) {
-    for (auto f : collabs_) {
-      f(buffer);
+  void Register(std::function<void(Buffer*)> f, unsigned start) {
+    collabs_.emplace_back(start | kCreated, f);
+  }
+
+  // start collaborators whose conditions hold in after but not in before
+  void Run(Buffer* buffer, unsigned before, unsigned after) {
+    for (const auto& c : collabs_) {
+      if ((c.first & after) == c.first && (c.first & before) != c.first) {
+        c.second(buffer);
+      }
     }
   }
 
  private:
-  std::vector<std::function<void(Buffer*)> > collabs_;
+  std::vector<std::pair<unsigned, std::function<void(Buffer*)>>> collabs_;
 };
 
 }  // namespace
 
 Buffer::Buffer(Project* project, const boost::filesystem::path& filename,
                absl::optional<AnnotatedString> initial_string,
-               absl::optional<int> site_id, bool synthetic)
+               absl::optional<int> site_id, bool synthetic,
+               bool fully_loaded)
     : project_(project),
       synthetic_(synthetic),
+      initially_loaded_(fully_loaded),
       version_(0),
+      log_(project ? new CommandLog(FLAGS_buffer_command_log_bytes) : nullptr),
+      epoch_(NewEpoch()),
       updating_(false),
+      shutdown_(false),
       last_used_(absl::Now() - absl::Seconds(1000000)),
       filename_(filename),
+      created_(absl::Now()),
+      start_conditions_(0),
+      closing_(false),
       site_(site_id) {
-  if (initial_string) state_.content = *initial_string;
-  init_thread_ =
-      std::thread([this]() { CollaboratorRegistry::Get().Run(this); });
+  auto initial_state = std::make_shared<EditNotification>();
+  if (initial_string) initial_state->content = *initial_string;
+  initial_state->fully_loaded = fully_loaded;
+  state_ = std::move(initial_state);
+  absl::MutexLock lock(&mu_);
+  MeetStartConditions(CollaboratorRegistry::kCreated |
+                      (fully_loaded ? kStartOnLoaded : kStartImmediately));
 }
 
 void Buffer::RegisterCollaborator(
-    std::function<void(Buffer*)> maybe_init_collaborator) {
-  CollaboratorRegistry::Get().Register(maybe_init_collaborator);
+    std::function<void(Buffer*)> maybe_init_collaborator, unsigned start) {
+  CollaboratorRegistry::Get().Register(maybe_init_collaborator, start);
 }
 
-Buffer::~Buffer() {
+void Buffer::MeetStartConditions(unsigned conditions) {
+  const unsigned before = start_conditions_;
+  const unsigned after = before | conditions;
+  if (after == before || closing_) return;
+  start_conditions_ = after;
+  init_threads_.emplace_back([this, before, after]() {
+    CollaboratorRegistry::Get().Run(this, before, after);
+  });
+}
+
+Buffer::~Buffer() { Close(); }
+
+void Buffer::Close() {
   const auto note = absl::StrCat("Buffer ", filename_.string(), " shutdown: ");
-  Log() << note << "Waiting for init thread";
-  init_thread_.join();
+  std::vector<std::thread> init_threads;
+  {
+    absl::MutexLock lock(&mu_);
+    if (closing_) return;
+    closing_ = true;
+    init_threads.swap(init_threads_);
+  }
+  Log() << note << "Waiting for init threads";
+  for (auto& t : init_threads) t.join();
 
   UpdateState(nullptr, false,
               [](EditNotification& state) { state.shutdown = true; });
@@ -108,27 +206,35 @@ void Buffer::AddCollaborator(AsyncCollaboratorPtr&& collaborator) {
 }
 
 void Buffer::AddCollaborator(AsyncCommandCollaboratorPtr&& collaborator) {
-  class Listener final : public BufferListener {
-   public:
-    Listener(Buffer* buffer, AsyncCommandCollaborator* collab)
-        : BufferListener(buffer), collab_(collab) {}
-
-    void Update(const CommandSet* updates) { collab_->Push(updates); }
-
-   private:
-    AsyncCommandCollaborator* const collab_;
-  };
-
   absl::MutexLock lock(&mu_);
   AsyncCommandCollaborator* raw = collaborator.get();
   collaborators_.emplace_back(std::move(collaborator));
-  Listener* listener = new Listener(this, raw);
+  BufferListener* listener = new BufferListener(
+      this,
+      [raw](const PublishedUpdates& updates, const VersionVector&) {
+        CommandSet commands;
+        MergeUpdates(updates, &commands);
+        absl::Time start = absl::Now();
+        raw->Push(&commands);
+        raw->execution_us()->Add(MicrosSince(start));
+      },
+      nullptr,
+      [raw](const AnnotatedString& content, const CommandSet*,
+            const VersionVector&) {
+        // updates were dropped: send everything. Integrating is idempotent
+        // per character, so what the collaborator has already (including
+        // the start of a run sent here as one insert) is left as it is
+        CommandSet commands;
+        content.AsCommands(&commands);
+        raw->Push(&commands);
+      });
   collaborator_threads_.emplace(
       absl::StrCat(raw->name(), ".listener"),
       std::thread([this, raw, listener]() {
         Log() << raw->name() << " START LISTENER";
-        listener->Start([](const AnnotatedString&) {});
-        mu_.LockWhen(absl::Condition(&this->state_.shutdown));
+        listener->Start(nullptr, [](const AnnotatedString&, const CommandSet*,
+                                    const VersionVector&) {});
+        mu_.LockWhen(absl::Condition(&this->shutdown_));
         mu_.Unlock();
         Log() << raw->name() << " DELETE LISTENER";
         delete listener;
@@ -143,14 +249,20 @@ void Buffer::AddCollaborator(AsyncCommandCollaboratorPtr&& collaborator) {
           while (!shutdown) {
             CommandSet commands;
             Log() << raw->name() << " PULL";
+            absl::Time start = absl::Now();
             shutdown = !raw->Pull(&commands);
+            raw->pull_us()->Add(MicrosSince(start));
+            if (!commands.commands().empty()) {
+              raw->response_bytes()->Add(commands.ByteSizeLong());
+            }
             Log() << raw->name() << " PULL -> shutdown=" << shutdown;
-            PublishToListeners(&commands, listener);
-            UpdateState(raw, false, [&](EditNotification& state) {
-              Log() << raw->name() << " integrating";
-              state.content = state.content.Integrate(commands);
-              Log() << raw->name() << " integrating done";
-            });
+            UpdateState(raw, false,
+                        [&](EditNotification& state) {
+                          Log() << raw->name() << " integrating";
+                          state.content = state.content.Integrate(commands);
+                          Log() << raw->name() << " integrating done";
+                        },
+                        {&commands, listener, 0});
           }
         } catch (std::exception& e) {
           Log() << raw->name() << " collaborator pull broke: " << e.what();
@@ -185,23 +297,18 @@ EditNotification Buffer::NextNotification(Collaborator* collaborator,
                                           uint64_t* last_processed) {
   auto all_edits_complete = [this]() {
     mu_.AssertHeld();
-    return state_.shutdown &&
+    return shutdown_ &&
            declared_no_edit_collaborators_.size() == collaborators_.size();
   };
   auto processable = [&]() {
     mu_.AssertHeld();
-    Log() << filename_.string() << ":" << collaborator->name()
-          << ": v=" << version_ << " last=" << *last_processed
-          << " shutdown=" << state_.shutdown << " no_edits="
-          << NamesFromCollaborators(declared_no_edit_collaborators_)
-          << " from=" << NamesFromCollaborators(collaborators_);
     return version_ != *last_processed || all_edits_complete();
   };
   // wait until something interesting to work on
   mu_.LockWhen(absl::Condition(&processable));
   if (version_ != *last_processed) {
     absl::Time first_saw_change = absl::Now();
-    if (!state_.shutdown) {
+    if (!shutdown_) {
       absl::Time last_used_at_start;
       do {
         Log() << collaborator->name() << " last_used: " << last_used_;
@@ -212,20 +319,26 @@ EditNotification Buffer::NextNotification(Collaborator* collaborator,
               << " time_from_change: " << time_from_change;
         if (*last_processed != 0 &&
             mu_.AwaitWithTimeout(
-                absl::Condition(&state_.shutdown),
+                absl::Condition(&shutdown_),
                 std::max(collaborator->push_delay_from_idle() - idle_time,
                          collaborator->push_delay_from_start() -
                              time_from_change))) {
           break;
         }
-      } while (last_used_ != last_used_at_start && !state_.shutdown);
+      } while (last_used_ != last_used_at_start && !shutdown_);
     }
     *last_processed = version_;
-    EditNotification notification = state_;
-    collaborator->MarkRequest();
+    StatePtr state = LoadState();
+    auto pending = pending_since_.find(collaborator);
+    if (pending != pending_since_.end()) {
+      collaborator->queue_delay_us()->Add(MicrosSince(pending->second));
+      pending_since_.erase(pending);
+    }
     mu_.Unlock();
-    Log() << collaborator->name() << " notify";
-    return notification;
+    collaborator->MarkRequest();
+    Log() << filename_.string() << ":" << collaborator->name()
+          << " notify v=" << *last_processed;
+    return *state;
   } else {
     assert(all_edits_complete());
     done_collaborators_.insert(collaborator);
@@ -248,7 +361,8 @@ void IntegrateResponse(const EditResponse& response, EditNotification* state) {
 }
 
 void Buffer::UpdateState(Collaborator* collaborator, bool become_used,
-                         std::function<void(EditNotification& state)> f) {
+                         std::function<void(EditNotification& state)> f,
+                         const Publication& publish) {
   auto updatable = [this]() {
     mu_.AssertHeld();
     return !updating_;
@@ -256,12 +370,19 @@ void Buffer::UpdateState(Collaborator* collaborator, bool become_used,
 
   // get the update lock
   mu_.LockWhen(absl::Condition(&updatable));
-  if (collaborator) collaborator->MarkChange();
   updating_ = true;
-  auto state = state_;
   mu_.Unlock();
 
+  if (collaborator) collaborator->MarkChange();
+  // only one updater at a time, so nobody can replace state_ until we commit
+  EditNotification state = *LoadState();
+  absl::Time integration_start = absl::Now();
   f(state);
+  if (collaborator) {
+    collaborator->integration_us()->Add(MicrosSince(integration_start));
+  }
+  StatePtr new_state =
+      std::make_shared<const EditNotification>(std::move(state));
 
   // commit the update and advance time
   mu_.Lock();
@@ -270,7 +391,6 @@ void Buffer::UpdateState(Collaborator* collaborator, bool become_used,
         << (collaborator ? collaborator->name() : "<nil>")
         << " updates version";
 
-  updating_ = false;
   version_++;
 
   if (!done_collaborators_.empty()) {
@@ -278,40 +398,72 @@ void Buffer::UpdateState(Collaborator* collaborator, bool become_used,
   }
 
   declared_no_edit_collaborators_ = done_collaborators_;
-  state_ = state;
+  const absl::Time now = absl::Now();
+  for (const auto& c : collaborators_) {
+    // keeps the earliest time if the collaborator is already behind
+    pending_since_.emplace(c.get(), now);
+  }
+  shutdown_ = new_state->shutdown;
+  if (new_state->fully_loaded) MeetStartConditions(kStartOnLoaded);
+  std::atomic_store(&state_, std::move(new_state));
   if (become_used) {
     last_used_ = absl::Now();
   }
   mu_.Unlock();
+
+  // still holding the update lock
+  if (publish.commands) PublishToListeners(publish);
+
+  mu_.Lock();
+  updating_ = false;
+  mu_.Unlock();
+}
+
+void Buffer::BetweenUpdates(const std::function<void()>& f) {
+  auto updatable = [this]() {
+    mu_.AssertHeld();
+    return !updating_;
+  };
+  mu_.LockWhen(absl::Condition(&updatable));
+  updating_ = true;
+  mu_.Unlock();
+  f();
+  mu_.Lock();
+  updating_ = false;
+  mu_.Unlock();
 }
 
-void Buffer::PushChanges(const CommandSet* commands, bool become_used) {
-  PublishToListeners(commands, nullptr);
+void Buffer::PushChanges(const CommandSet* commands, bool become_used,
+                         int origin) {
   UpdateState(nullptr, become_used,
               [become_used, commands](EditNotification& state) {
                 state.content = state.content.Integrate(*commands);
-              });
+              },
+              {commands, nullptr, origin});
 }
 
-AnnotatedString Buffer::ContentSnapshot() {
-  absl::MutexLock lock(&mu_);
-  return state_.content;
+AnnotatedString Buffer::ContentSnapshot() const {
+  return LoadState()->content;
+}
+
+bool Buffer::HasListeners() const {
+  absl::MutexLock lock(&listeners_mu_);
+  return !listeners_.empty();
 }
 
 void Buffer::SinkResponse(Collaborator* collaborator,
                           const EditResponse& response) {
-  {
-    absl::MutexLock lock(&mu_);
-    collaborator->MarkResponse();
-  }
+  collaborator->MarkResponse();
 
   if (HasUpdates(response)) {
-    PublishToListeners(&response.content_updates, nullptr);
+    collaborator->response_bytes()->Add(
+        response.content_updates.ByteSizeLong());
     UpdateState(collaborator, response.become_used,
                 [&](EditNotification& state) {
                   Log() << collaborator->name() << " integrating";
                   IntegrateResponse(response, &state);
-                });
+                },
+                {&response.content_updates, nullptr, 0});
   } else {
     Log() << collaborator->name() << " gives an empty update";
     absl::MutexLock lock(&mu_);
@@ -331,12 +483,19 @@ void Buffer::SinkResponse(Collaborator* collaborator,
   }
 }
 
-void Buffer::PublishToListeners(const CommandSet* commands,
-                                BufferListener* except) {
-  absl::MutexLock lock(&mu_);
+void Buffer::PublishToListeners(const Publication& publish) {
+  if (publish.commands->commands().empty()) return;
+  static const VersionVector kUnversioned;
+  absl::MutexLock lock(&listeners_mu_);
+  const VersionVector& version =
+      log_ ? log_->Append(publish.origin ? publish.origin : site_.site_id(),
+                          *publish.commands)
+           : kUnversioned;
+  std::shared_ptr<const PublishedUpdate> update;
   for (auto* l : listeners_) {
-    if (l == except) continue;
-    l->Update(commands);
+    if (l == publish.except) continue;
+    if (!update) update = std::make_shared<PublishedUpdate>(*publish.commands);
+    l->Enqueue(update, version);
   }
 }
 
@@ -344,7 +503,11 @@ void Buffer::RunPush(AsyncCollaborator* collaborator) {
   uint64_t processed_version = 0;
   try {
     for (;;) {
-      collaborator->Push(NextNotification(collaborator, &processed_version));
+      EditNotification notification =
+          NextNotification(collaborator, &processed_version);
+      absl::Time start = absl::Now();
+      collaborator->Push(notification);
+      collaborator->execution_us()->Add(MicrosSince(start));
     }
   } catch (Shutdown) {
     return;
@@ -354,7 +517,10 @@ void Buffer::RunPush(AsyncCollaborator* collaborator) {
 void Buffer::RunPull(AsyncCollaborator* collaborator) {
   try {
     for (;;) {
-      SinkResponse(collaborator, collaborator->Pull());
+      absl::Time start = absl::Now();
+      EditResponse response = collaborator->Pull();
+      collaborator->pull_us()->Add(MicrosSince(start));
+      SinkResponse(collaborator, response);
     }
   } catch (Shutdown) {
     return;
@@ -365,8 +531,12 @@ void Buffer::RunSync(SyncCollaborator* collaborator) {
   uint64_t processed_version = 0;
   try {
     for (;;) {
-      SinkResponse(collaborator, collaborator->Edit(NextNotification(
-                                     collaborator, &processed_version)));
+      EditNotification notification =
+          NextNotification(collaborator, &processed_version);
+      absl::Time start = absl::Now();
+      EditResponse response = collaborator->Edit(notification);
+      collaborator->execution_us()->Add(MicrosSince(start));
+      SinkResponse(collaborator, response);
     }
   } catch (Shutdown) {
     return;
@@ -374,11 +544,15 @@ void Buffer::RunSync(SyncCollaborator* collaborator) {
 }
 
 std::vector<std::string> Buffer::ProfileData() const {
+  std::vector<const Collaborator*> collaborators;
+  {
+    absl::MutexLock lock(&mu_);
+    for (const auto& c : collaborators_) collaborators.push_back(c.get());
+  }
   auto now = absl::Now();
-  absl::MutexLock lock(&mu_);
   std::vector<std::string> out;
-  for (const auto& c : collaborators_) {
-    auto report = [&out, now, this, &c](const char* name,
+  for (const auto* c : collaborators) {
+    auto report = [&out, now, this, c](const char* name,
                                         absl::Time timestamp) {
       auto age = now - timestamp;
       if (age > absl::Seconds(5)) return;
@@ -390,38 +564,276 @@ std::vector<std::string> Buffer::ProfileData() const {
     report("rsp", c->last_response());
     report("rqst", c->last_request());
   }
+  BufferProfile profile;
+  Profile(&profile);
+  for (const auto& c : profile.collaborators()) {
+    auto report = [&out, this, &c](const char* name, const HistogramMsg& h) {
+      if (h.count() == 0) return;
+      out.emplace_back(absl::StrCat(filename().string(), ":", c.name(), ":",
+                                    name, ": ", HistogramSummary(h)));
+    };
+    report("queue_us", c.queue_delay_us());
+    report("exec_us", c.execution_us());
+    report("integrate_us", c.integration_us());
+    report("rsp_bytes", c.response_bytes());
+  }
+  if (profile.listener_traffic().messages_in() != 0) {
+    out.emplace_back(absl::StrCat(filename().string(), ":listeners: ",
+                                  ListenerTrafficSummary(profile)));
+  }
   return out;
 }
 
-BufferListener::BufferListener(Buffer* buffer) : buffer_(buffer) {}
+void Buffer::Profile(BufferProfile* profile) const {
+  ListenerTraffic* traffic = profile->mutable_listener_traffic();
+  traffic->set_messages_in(listener_messages_in_);
+  traffic->set_bytes_in(listener_bytes_in_);
+  traffic->set_messages_out(listener_messages_out_);
+  traffic->set_bytes_out(listener_bytes_out_);
+  traffic->set_elapsed_us(MicrosSince(created_));
+  absl::MutexLock lock(&mu_);
+  profile->set_filename(filename_.string());
+  for (const auto& c : collaborators_) {
+    c->ToProto(profile->add_collaborators());
+  }
+}
 
-BufferListener::~BufferListener() {
-  absl::MutexLock lock(&buffer_->mu_);
-  buffer_->listeners_.erase(this);
+std::string ListenerTrafficSummary(const BufferProfile& profile) {
+  const ListenerTraffic& t = profile.listener_traffic();
+  const double secs = std::max<uint64_t>(t.elapsed_us(), 1) / 1e6;
+  return absl::StrCat(
+      "in ", static_cast<int64_t>(t.messages_in() / secs), " msg/s ",
+      static_cast<int64_t>(t.bytes_in() / secs), " B/s; out ",
+      static_cast<int64_t>(t.messages_out() / secs), " msg/s ",
+      static_cast<int64_t>(t.bytes_out() / secs), " B/s");
 }
 
-void BufferListener::Start(
-    std::function<void(const AnnotatedString&)> initial) {
-  absl::MutexLock lock(&buffer_->mu_);
-  buffer_->listeners_.insert(this);
-  initial(buffer_->state_.content);
+void MergeCollaboratorProfile(const CollaboratorProfile& from,
+                              CollaboratorProfile* into) {
+  into->set_name(from.name());
+  MergeHistogram(from.queue_delay_us(), into->mutable_queue_delay_us());
+  MergeHistogram(from.execution_us(), into->mutable_execution_us());
+  MergeHistogram(from.pull_us(), into->mutable_pull_us());
+  MergeHistogram(from.integration_us(), into->mutable_integration_us());
+  MergeHistogram(from.response_bytes(), into->mutable_response_bytes());
 }
 
-std::unique_ptr<BufferListener> Buffer::Listen(
-    std::function<void(const AnnotatedString&)> initial,
-    std::function<void(const CommandSet*)> update) {
-  class FnListener final : public BufferListener {
-   public:
-    FnListener(Buffer* buffer, std::function<void(const CommandSet*)> update)
-        : BufferListener(buffer), update_(update) {}
+void Collaborator::ToProto(CollaboratorProfile* profile) const {
+  profile->set_name(name_);
+  queue_delay_us_.ToProto(profile->mutable_queue_delay_us());
+  execution_us_.ToProto(profile->mutable_execution_us());
+  pull_us_.ToProto(profile->mutable_pull_us());
+  integration_us_.ToProto(profile->mutable_integration_us());
+  response_bytes_.ToProto(profile->mutable_response_bytes());
+}
+
+PublishedUpdate::PublishedUpdate(const CommandSet& commands)
+    : commands_(commands),
+      bytes_(commands_.ByteSizeLong()),
+      interactive_(IsInteractive(commands_)) {}
 
-    void Update(const CommandSet* updates) { update_(updates); }
+const std::string& PublishedUpdate::Serialized() const {
+  std::call_once(serialize_once_,
+                 [this]() { commands_.SerializeToString(&serialized_); });
+  return serialized_;
+}
+
+void MergeUpdates(const PublishedUpdates& updates, CommandSet* out) {
+  for (const auto& update : updates) {
+    out->MergeFrom(update->commands());
+  }
+}
 
-   private:
-    std::function<void(const CommandSet*)> update_;
+BufferListener::BufferListener(Buffer* buffer, UpdateFn update,
+                               std::function<void()> disconnect,
+                               InitialFn resync)
+    : buffer_(buffer),
+      update_(update),
+      disconnect_(disconnect),
+      resync_(resync) {
+  // overflowing drops updates: something has to be done about that
+  assert(disconnect_ || resync_);
+}
+
+BufferListener::~BufferListener() {
+  {
+    absl::MutexLock lock(&buffer_->listeners_mu_);
+    buffer_->listeners_.erase(this);
+  }
+  auto idle = [this]() {
+    mu_.AssertHeld();
+    return !delivering_ && !disconnecting_ && !scheduled_now_ &&
+           !scheduled_later_;
   };
+  absl::MutexLock lock(&mu_);
+  shutdown_ = true;
+  mu_.Await(absl::Condition(&idle));
+}
 
-  std::unique_ptr<BufferListener> listener(new FnListener(this, update));
-  listener->Start(initial);
+void BufferListener::Start(const VersionVector* since, InitialFn initial) {
+  VersionVector version;
+  CommandSet missed;
+  bool have_missed = false;
+  Buffer::StatePtr state;
+  // between updates, every committed update has been published (and none
+  // more): the content loaded holds exactly what version counts, and each
+  // later update is queued to us. Those are held until we've started, so
+  // none can be delivered ahead of the initial state
+  buffer_->BetweenUpdates([&]() {
+    absl::MutexLock lock(&buffer_->listeners_mu_);
+    buffer_->listeners_.insert(this);
+    state = buffer_->LoadState();
+    if (buffer_->log_) {
+      version = buffer_->log_->version();
+      if (since) have_missed = buffer_->log_->Since(*since, &missed);
+    }
+  });
+  initial(state->content, have_missed ? &missed : nullptr, version);
+  absl::MutexLock lock(&mu_);
+  started_ = true;
+  MaybeSchedule();
+}
+
+void BufferListener::Resync() {
+  VersionVector version;
+  Buffer::StatePtr state;
+  // as in Start: the state loaded holds everything dropped, and everything
+  // queued from here on is newer
+  buffer_->BetweenUpdates([&]() {
+    absl::MutexLock lock(&buffer_->listeners_mu_);
+    absl::MutexLock self_lock(&mu_);
+    state = buffer_->LoadState();
+    if (buffer_->log_) version = buffer_->log_->version();
+    overflowed_ = false;
+    queue_.clear();
+    queued_bytes_ = 0;
+    interactive_ = false;
+    version_ = version;
+  });
+  Log() << buffer_->filename().string() << ": listener " << this
+        << " resynchronized after overflowing";
+  resync_(state->content, nullptr, version);
+}
+
+void BufferListener::Enqueue(
+    const std::shared_ptr<const PublishedUpdate>& update,
+    const VersionVector& version) {
+  buffer_->listener_messages_in_++;
+  buffer_->listener_bytes_in_ += update->bytes();
+  absl::MutexLock lock(&mu_);
+  if (overflowed_) return;
+  if (queued_bytes_ + update->bytes() >
+      static_cast<size_t>(FLAGS_listener_max_queued_bytes)) {
+    Log() << buffer_->filename().string() << ": listener " << this
+          << " overflowed with " << queue_.size() << " pending updates ("
+          << queued_bytes_ << " bytes)";
+    overflowed_ = true;
+    queue_.clear();
+    queued_bytes_ = 0;
+    if (disconnect_) {
+      // now, not after the delivery in progress: that may never return
+      disconnecting_ = true;
+      DisconnectPool()->Schedule([this]() { Disconnect(); });
+    } else {
+      MaybeSchedule();
+    }
+    return;
+  }
+  queue_.push_back(update);
+  queued_bytes_ += update->bytes();
+  version_ = version;
+  interactive_ |= update->interactive();
+  MaybeSchedule();
+}
+
+void BufferListener::MaybeSchedule() {
+  // whoever is delivering schedules what queued up behind it when it's done
+  if (!started_ || shutdown_ || disconnecting_ || delivering_) return;
+  if (overflowed_ || interactive_ || queued_bytes_ >= kMaxBatchBytes) {
+    if (scheduled_now_) return;
+    scheduled_now_ = true;
+    DeliveryPool()->Schedule([this]() { Deliver(false); });
+  } else if (!queue_.empty() && !scheduled_now_ && !scheduled_later_) {
+    // Nagle: give annotation-only traffic a moment to accumulate so that a
+    // burst of collaborator responses goes out as one message
+    scheduled_later_ = true;
+    DeliveryPool()->ScheduleAt(
+        absl::Now() + absl::Microseconds(FLAGS_listener_batch_linger_us),
+        [this]() { Deliver(true); });
+  }
+}
+
+void BufferListener::Deliver(bool delayed) {
+  mu_.Lock();
+  (delayed ? scheduled_later_ : scheduled_now_) = false;
+  if (shutdown_ || disconnecting_ || delivering_ ||
+      (queue_.empty() && !overflowed_)) {
+    mu_.Unlock();
+    return;
+  }
+  delivering_ = true;
+  if (overflowed_) {
+    mu_.Unlock();
+    Resync();
+    absl::MutexLock lock(&mu_);
+    delivering_ = false;
+    MaybeSchedule();
+    return;
+  }
+  // deliver everything that queued up behind the last delivery at once
+  PublishedUpdates updates;
+  updates.swap(queue_);
+  // a single repeated field: the merged size is the sum of the parts
+  buffer_->listener_messages_out_++;
+  buffer_->listener_bytes_out_ += queued_bytes_;
+  queued_bytes_ = 0;
+  interactive_ = false;
+  const VersionVector version = version_;
+  mu_.Unlock();
+  update_(updates, version);
+  absl::MutexLock lock(&mu_);
+  delivering_ = false;
+  MaybeSchedule();
+}
+
+void BufferListener::Disconnect() {
+  bool destroying;
+  {
+    absl::MutexLock lock(&mu_);
+    destroying = shutdown_;
+    shutdown_ = true;
+  }
+  // a listener being destroyed is going anyway, and its owner with it
+  if (!destroying) disconnect_();
+  absl::MutexLock lock(&mu_);
+  disconnecting_ = false;
+}
+
+std::unique_ptr<BufferListener> Buffer::Listen(
+    std::function<void(const AnnotatedString&)> initial,
+    std::function<void(const CommandSet*)> update,
+    std::function<void()> disconnect) {
+  return ListenVersioned(
+      nullptr,
+      [initial](const AnnotatedString& content, const CommandSet*,
+                const VersionVector&) { initial(content); },
+      [update](const PublishedUpdates& updates, const VersionVector&) {
+        CommandSet commands;
+        MergeUpdates(updates, &commands);
+        update(&commands);
+      },
+      disconnect);
+}
+
+std::unique_ptr<BufferListener> Buffer::ListenVersioned(
+    const VersionVector* since, BufferListener::InitialFn initial,
+    BufferListener::UpdateFn update, std::function<void()> disconnect) {
+  {
+    absl::MutexLock lock(&mu_);
+    MeetStartConditions(kStartOnListener);
+  }
+  std::unique_ptr<BufferListener> listener(
+      new BufferListener(this, update, disconnect));
+  listener->Start(since, initial);
   return listener;
 }
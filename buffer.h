@@ -14,11 +14,17 @@
 #pragma once
 
 #include <boost/filesystem.hpp>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/types/optional.h"
 #include "annotated_string.h"
+#include "command_log.h"
+#include "histogram.h"
 #include "selector.h"
 
 class Project;
@@ -42,17 +48,97 @@ void IntegrateResponse(const EditResponse& response, EditNotification* state);
 
 class Buffer;
 
+// A CommandSet as published to a buffer's listeners. One instance is shared
+// by all of them, so it's copied, measured and (if anyone asks for it)
+// serialized once however many are attached.
+class PublishedUpdate {
+ public:
+  explicit PublishedUpdate(const CommandSet& commands);
+
+  const CommandSet& commands() const { return commands_; }
+  size_t bytes() const { return bytes_; }
+  // edits content, rather than just annotating it
+  bool interactive() const { return interactive_; }
+  // commands() in wire format: serialized by the first caller
+  const std::string& Serialized() const;
+
+ private:
+  const CommandSet commands_;
+  const size_t bytes_;
+  const bool interactive_;
+  mutable std::once_flag serialize_once_;
+  mutable std::string serialized_;
+};
+
+typedef std::vector<std::shared_ptr<const PublishedUpdate>> PublishedUpdates;
+
+// merge the commands of updates, in order, into out
+void MergeUpdates(const PublishedUpdates& updates, CommandSet* out);
+
+// Receives every CommandSet published to a buffer.
+// Publishing only appends to a bounded per-listener queue, which is drained
+// by a process wide pool of delivery threads: each delivery merges
+// everything that queued up while the previous one was in progress, and a
+// listener has at most one in progress at a time. A listener that falls too
+// far behind is disconnected rather than being allowed to stall the buffer.
 class BufferListener {
  public:
+  // waits for any delivery in progress: must not be called from update
   ~BufferListener();
 
+  typedef std::function<void(const AnnotatedString& content,
+                             const CommandSet* missed,
+                             const VersionVector& version)>
+      InitialFn;
+  // updates holds everything that queued up since the last call. Runs on a
+  // shared thread: time spent blocked here delays other listeners
+  typedef std::function<void(const PublishedUpdates& updates,
+                             const VersionVector& version)>
+      UpdateFn;
+
  private:
   friend class Buffer;
-  virtual void Update(const CommandSet* updates) = 0;
-  void Start(std::function<void(const AnnotatedString&)> init);
-  BufferListener(Buffer* buffer);
+  // if the queue overflows, the updates in it are dropped: the listener is
+  // then either disconnected, or (if disconnect is null) brought up to date
+  // by passing the current content to resync, and delivery carries on
+  BufferListener(Buffer* buffer, UpdateFn update,
+                 std::function<void()> disconnect, InitialFn resync = nullptr);
+  void Start(const VersionVector* since, InitialFn initial);
+  void Resync();
+  // called with the buffer's listeners_mu_ held: must never block
+  void Enqueue(const std::shared_ptr<const PublishedUpdate>& update,
+               const VersionVector& version);
+  // hand the queue to the delivery pool, now or once it's done lingering
+  void MaybeSchedule() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // run by the delivery pool: delayed is whether it was scheduled to linger
+  void Deliver(bool delayed);
+  // run by the disconnect pool once the queue overflows, if disconnect_ is
+  // set: whether or not a delivery is in progress
+  void Disconnect();
 
   Buffer* const buffer_;
+  const UpdateFn update_;
+  const std::function<void()> disconnect_;
+  const InitialFn resync_;
+  absl::Mutex mu_;
+  PublishedUpdates queue_ GUARDED_BY(mu_);
+  // command log version after the last queued update
+  VersionVector version_ GUARDED_BY(mu_);
+  size_t queued_bytes_ GUARDED_BY(mu_) = 0;
+  // the queue holds a content edit: deliver without lingering
+  bool interactive_ GUARDED_BY(mu_) = false;
+  bool overflowed_ GUARDED_BY(mu_) = false;
+  // the initial state has been delivered: updates may follow
+  bool started_ GUARDED_BY(mu_) = false;
+  // disconnected, or being destroyed: nothing more is delivered
+  bool shutdown_ GUARDED_BY(mu_) = false;
+  // a delivery (or resync) is in progress
+  bool delivering_ GUARDED_BY(mu_) = false;
+  // overflowed, and disconnect_ is yet to return
+  bool disconnecting_ GUARDED_BY(mu_) = false;
+  // Deliver calls scheduled to run immediately, and after lingering
+  bool scheduled_now_ GUARDED_BY(mu_) = false;
+  bool scheduled_later_ GUARDED_BY(mu_) = false;
 };
 
 class Collaborator {
@@ -65,13 +151,21 @@ class Collaborator {
     return push_delay_from_start_;
   }
 
-  void MarkRequest() { last_request_ = absl::Now(); }
-  void MarkResponse() { last_response_ = absl::Now(); }
-  void MarkChange() { last_change_ = absl::Now(); }
+  void MarkRequest() { Mark(&last_request_); }
+  void MarkResponse() { Mark(&last_response_); }
+  void MarkChange() { Mark(&last_change_); }
 
-  const absl::Time& last_response() const { return last_response_; }
-  const absl::Time& last_request() const { return last_request_; }
-  const absl::Time& last_change() const { return last_change_; }
+  absl::Time last_response() const { return Read(last_response_); }
+  absl::Time last_request() const { return Read(last_request_); }
+  absl::Time last_change() const { return Read(last_change_); }
+
+  Histogram* queue_delay_us() { return &queue_delay_us_; }
+  Histogram* execution_us() { return &execution_us_; }
+  Histogram* pull_us() { return &pull_us_; }
+  Histogram* integration_us() { return &integration_us_; }
+  Histogram* response_bytes() { return &response_bytes_; }
+
+  void ToProto(CollaboratorProfile* profile) const;
 
  protected:
   Collaborator(const char* name, absl::Duration push_delay_from_idle,
@@ -81,17 +175,38 @@ class Collaborator {
         push_delay_from_start_(push_delay_from_start) {}
 
  private:
+  // timestamps are stored as unix nanos so they can be marked and read
+  // without holding the owning buffer's lock
+  typedef std::atomic<int64_t> Timestamp;
+  static void Mark(Timestamp* ts) {
+    ts->store(absl::ToUnixNanos(absl::Now()), std::memory_order_relaxed);
+  }
+  static absl::Time Read(const Timestamp& ts) {
+    return absl::FromUnixNanos(ts.load(std::memory_order_relaxed));
+  }
+
   const char* const name_;
   const absl::Duration push_delay_from_idle_;
   const absl::Duration push_delay_from_start_;
-  absl::Time last_response_ = absl::Now();
-  absl::Time last_request_ = absl::Now();
-  absl::Time last_change_ = absl::Now();
+  Timestamp last_response_{absl::ToUnixNanos(absl::Now())};
+  Timestamp last_request_{absl::ToUnixNanos(absl::Now())};
+  Timestamp last_change_{absl::ToUnixNanos(absl::Now())};
   absl::Duration last_notify_ = absl::Seconds(0);
+  Histogram queue_delay_us_;
+  Histogram execution_us_;
+  Histogram pull_us_;
+  Histogram integration_us_;
+  Histogram response_bytes_;
 };
 
 typedef std::unique_ptr<Collaborator> CollaboratorPtr;
 
+// rates of listener traffic over the life of the buffer
+std::string ListenerTrafficSummary(const BufferProfile& profile);
+
+void MergeCollaboratorProfile(const CollaboratorProfile& from,
+                              CollaboratorProfile* into);
+
 class AsyncCollaborator : public Collaborator {
  public:
   virtual void Push(const EditNotification& notification) = 0;
@@ -132,9 +247,23 @@ typedef std::unique_ptr<AsyncCollaborator> AsyncCollaboratorPtr;
 typedef std::unique_ptr<AsyncCommandCollaborator> AsyncCommandCollaboratorPtr;
 typedef std::unique_ptr<SyncCollaborator> SyncCollaboratorPtr;
 
+// Conditions under which a collaborator is instantiated for a buffer: each
+// collaborator starts the first time all of the conditions it declares hold,
+// so buffers that are only peeked at don't pay for every collaborator
+enum CollaboratorStart : unsigned {
+  kStartImmediately = 0,
+  // something outside the buffer (an editing client) is listening to it
+  kStartOnListener = 1,
+  // the buffer's content has been fully loaded
+  kStartOnLoaded = 2,
+};
+
 class Buffer {
  public:
   ~Buffer();
+  // stop and join every collaborator (the io collaborator saves the file as
+  // it goes): the content is final from here on. Also done on destruction
+  void Close();
 
   class Builder {
    public:
@@ -163,10 +292,18 @@ class Buffer {
       return *this;
     }
 
+    // the initial string is the complete content of the file: collaborators
+    // that would otherwise load it (see initially_loaded()) skip doing so
+    Builder& SetFullyLoaded(bool fully_loaded = true) {
+      fully_loaded_ = fully_loaded;
+      return *this;
+    }
+
     std::unique_ptr<Buffer> Make() {
       assert(filename_);
       return std::unique_ptr<Buffer>(new Buffer(
-          project_, *filename_, initial_string_, site_id_, synthetic_));
+          project_, *filename_, initial_string_, site_id_, synthetic_,
+          fully_loaded_));
     }
 
    private:
@@ -175,6 +312,7 @@ class Buffer {
     absl::optional<int> site_id_;
     Project* project_ = nullptr;
     bool synthetic_ = false;
+    bool fully_loaded_ = false;
   };
 
   Buffer(const Buffer&) = delete;
@@ -194,27 +332,54 @@ class Buffer {
   const boost::filesystem::path& filename() const { return filename_; }
   bool read_only() const { return false; }
   bool synthetic() const { return synthetic_; }
+  bool initially_loaded() const { return initially_loaded_; }
   bool is_server() const { return project_ != nullptr; }
   bool is_client() const { return !is_server(); }
 
   std::vector<std::string> ProfileData() const;
+  void Profile(BufferProfile* profile) const;
 
   static void RegisterCollaborator(
-      std::function<void(Buffer*)> maybe_init_collaborator);
-
-  void PushChanges(const CommandSet* cmds, bool become_used);
-  AnnotatedString ContentSnapshot();
+      std::function<void(Buffer*)> maybe_init_collaborator,
+      unsigned start = kStartImmediately);
+
+  // origin is the site the commands came from, if not this buffer's own
+  void PushChanges(const CommandSet* cmds, bool become_used, int origin = 0);
+  AnnotatedString ContentSnapshot() const;
+  size_t ApproximateMemoryUsage() const {
+    return ContentSnapshot().ApproximateMemoryUsage();
+  }
+  bool HasListeners() const;
 
+  // initial is called once with the current content before any update is
+  // delivered; disconnect is called if the listener's queue overflows, after
+  // which no further updates are delivered. It may run while an update is
+  // still being delivered (that's often why the queue overflowed), on
+  // another thread: it must not wait for that update to return
   std::unique_ptr<BufferListener> Listen(
       std::function<void(const AnnotatedString&)> initial,
-      std::function<void(const CommandSet*)> update);
+      std::function<void(const CommandSet*)> update,
+      std::function<void()> disconnect);
+
+  // As Listen, with the version of the buffer's command log attached to the
+  // initial content and to every update (servers keep a log, clients don't
+  // and always report an empty version). If since is set and the log still
+  // holds everything published after it, initial also receives exactly those
+  // commands as missed; otherwise missed is null.
+  std::unique_ptr<BufferListener> ListenVersioned(
+      const VersionVector* since, BufferListener::InitialFn initial,
+      BufferListener::UpdateFn update, std::function<void()> disconnect);
+
+  // distinguishes this buffer from any other instance for the same file:
+  // versions are only comparable between listeners of the same epoch
+  uint64_t epoch() const { return epoch_; }
 
  private:
   friend class BufferListener;
 
   Buffer(Project* project, const boost::filesystem::path& filename,
          absl::optional<AnnotatedString> initial_string,
-         absl::optional<int> site_id, bool synthetic);
+         absl::optional<int> site_id, bool synthetic, bool fully_loaded);
 
   void AddCollaborator(AsyncCollaboratorPtr&& collaborator);
   void AddCollaborator(AsyncCommandCollaboratorPtr&& collaborator);
@@ -228,46 +393,93 @@ class Buffer {
   void RunPull(AsyncCollaborator* collaborator);
   void RunSync(SyncCollaborator* collaborator);
 
+  struct Publication {
+    const CommandSet* commands;
+    // listener that produced the commands, which needn't hear them back
+    BufferListener* except;
+    // site the commands came from (0 for this buffer's)
+    int origin;
+  };
+  // publish is sent to listeners once the update is committed, but before
+  // any other update can commit: so listeners see updates in the order they
+  // were integrated, and one that attaches sees each either in its initial
+  // content or as an update
   void UpdateState(Collaborator* collaborator, bool become_used,
-                   std::function<void(EditNotification& new_state)>);
-  void PublishToListeners(const CommandSet* command_set,
-                          BufferListener* except);
+                   std::function<void(EditNotification& new_state)>,
+                   const Publication& publish = {nullptr, nullptr, 0});
+  void PublishToListeners(const Publication& publish);
+  // run f holding the update lock: no update is part way through
+  // committing and publishing
+  void BetweenUpdates(const std::function<void()>& f);
+  // record that conditions now hold, and start any collaborators waiting
+  // for them
+  void MeetStartConditions(unsigned conditions) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  typedef std::shared_ptr<const EditNotification> StatePtr;
+  // lock-free read of the most recently committed state
+  StatePtr LoadState() const { return std::atomic_load(&state_); }
 
   Project* const project_;
   mutable absl::Mutex mu_;
+  // guards listeners_ separately from mu_ so that publishing to listeners
+  // never contends with collaborator bookkeeping
+  mutable absl::Mutex listeners_mu_ ACQUIRED_AFTER(mu_);
   const bool synthetic_;
+  const bool initially_loaded_;
   uint64_t version_ GUARDED_BY(mu_);
   std::set<Collaborator*> declared_no_edit_collaborators_ GUARDED_BY(mu_);
   std::set<Collaborator*> done_collaborators_ GUARDED_BY(mu_);
-  std::set<BufferListener*> listeners_ GUARDED_BY(mu_);
+  // when each collaborator first had an unprocessed version waiting for it
+  std::map<Collaborator*, absl::Time> pending_since_ GUARDED_BY(mu_);
+  std::set<BufferListener*> listeners_ GUARDED_BY(listeners_mu_);
+  // server side only: history for resuming listeners
+  std::unique_ptr<CommandLog> log_ GUARDED_BY(listeners_mu_);
+  const uint64_t epoch_;
   bool updating_ GUARDED_BY(mu_);
+  bool shutdown_ GUARDED_BY(mu_);
   absl::Time last_used_ GUARDED_BY(mu_);
   const boost::filesystem::path filename_;
-  EditNotification state_ GUARDED_BY(mu_);
+  const absl::Time created_;
+  std::atomic<uint64_t> listener_messages_in_{0};
+  std::atomic<uint64_t> listener_bytes_in_{0};
+  std::atomic<uint64_t> listener_messages_out_{0};
+  std::atomic<uint64_t> listener_bytes_out_{0};
+  // immutable snapshot of the current state: replaced wholesale (under mu_,
+  // alongside version_) by UpdateState, read with std::atomic_load
+  StatePtr state_;
   std::vector<CollaboratorPtr> collaborators_ GUARDED_BY(mu_);
   std::map<std::string, std::thread> collaborator_threads_ GUARDED_BY(mu_);
-  std::thread init_thread_;
+  // CollaboratorStart conditions that have held
+  unsigned start_conditions_ GUARDED_BY(mu_);
+  // set by the destructor: no further collaborators may start
+  bool closing_ GUARDED_BY(mu_);
+  std::vector<std::thread> init_threads_ GUARDED_BY(mu_);
   mutable Site site_;
 };
 
-#define IMPL_COLLABORATOR(name, buffer_arg, client_side)                 \
-  namespace {                                                            \
-  class name##_impl {                                                    \
-   public:                                                               \
-    static bool ShouldAdd(const Buffer* buffer_arg);                     \
-    name##_impl() {                                                      \
-      Buffer::RegisterCollaborator([](Buffer* buffer) {                  \
-        if (buffer->is_client() == (client_side) && ShouldAdd(buffer)) { \
-          buffer->MakeCollaborator<name>();                              \
-        }                                                                \
-      });                                                                \
-    }                                                                    \
-  };                                                                     \
-  name##_impl impl;                                                      \
-  }                                                                      \
+#define IMPL_COLLABORATOR(name, buffer_arg, client_side, start)             \
+  namespace {                                                              \
+  class name##_impl {                                                      \
+   public:                                                                 \
+    static bool ShouldAdd(const Buffer* buffer_arg);                       \
+    name##_impl() {                                                        \
+      Buffer::RegisterCollaborator(                                        \
+          [](Buffer* buffer) {                                             \
+            if (buffer->is_client() == (client_side) && ShouldAdd(buffer)) { \
+              buffer->MakeCollaborator<name>();                            \
+            }                                                              \
+          },                                                               \
+          (start));                                                        \
+    }                                                                      \
+  };                                                                       \
+  name##_impl impl;                                                        \
+  }                                                                        \
   bool name##_impl::ShouldAdd(const Buffer* buffer_arg)
 
 #define CLIENT_COLLABORATOR(name, buffer_arg) \
-  IMPL_COLLABORATOR(name, buffer_arg, true)
+  IMPL_COLLABORATOR(name, buffer_arg, true, kStartImmediately)
 #define SERVER_COLLABORATOR(name, buffer_arg) \
-  IMPL_COLLABORATOR(name, buffer_arg, false)
+  IMPL_COLLABORATOR(name, buffer_arg, false, kStartImmediately)
+// start is a combination of CollaboratorStart conditions
+#define LAZY_SERVER_COLLABORATOR(name, start, buffer_arg) \
+  IMPL_COLLABORATOR(name, buffer_arg, false, start)
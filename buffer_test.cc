@@ -12,6 +12,85 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "buffer.h"
+#include <gflags/gflags.h>
 #include "gtest/gtest.h"
 
-TEST(Buffer, NoOp) { Buffer b; }
+DECLARE_int64(listener_max_queued_bytes);
+
+TEST(Buffer, NoOp) {
+  Buffer::Builder().SetFilename("x.txt").SetSynthetic().Make();
+}
+
+TEST(Buffer, ListenerBatchesAnnotations) {
+  auto buffer = Buffer::Builder().SetFilename("x.txt").SetSynthetic().Make();
+  absl::Mutex mu;
+  std::vector<int> batches;
+  auto listener = buffer->Listen([](const AnnotatedString&) {},
+                                 [&](const CommandSet* commands) {
+                                   absl::MutexLock lock(&mu);
+                                   batches.push_back(commands->commands_size());
+                                 },
+                                 []() { ADD_FAILURE() << "overflowed"; });
+  Site site;
+  for (int i = 0; i < 10; i++) {
+    CommandSet commands;
+    Attribute attr;
+    attr.mutable_tags()->add_tags("tag");
+    AnnotatedString::MakeDecl(&commands, &site, attr);
+    buffer->PushChanges(&commands, false);
+  }
+  CommandSet insert;
+  AnnotatedString::MakeRawInsert(&insert, &site, "a", AnnotatedString::Begin(),
+                                 AnnotatedString::End());
+  buffer->PushChanges(&insert, true);
+  auto all_delivered = [&]() {
+    int total = 0;
+    for (int n : batches) total += n;
+    return total == 11;
+  };
+  absl::MutexLock lock(&mu);
+  mu.Await(absl::Condition(&all_delivered));
+  EXPECT_LT(batches.size(), 11);
+}
+
+TEST(Buffer, ListenerDisconnectedWhileDeliveryBlocked) {
+  const int64_t max_queued_bytes = FLAGS_listener_max_queued_bytes;
+  FLAGS_listener_max_queued_bytes = 1024;
+  auto buffer = Buffer::Builder().SetFilename("x.txt").SetSynthetic().Make();
+  absl::Mutex mu;
+  bool blocked = false;
+  bool released = false;
+  bool disconnected = false;
+  auto listener = buffer->Listen([](const AnnotatedString&) {},
+                                 [&](const CommandSet*) {
+                                   absl::MutexLock lock(&mu);
+                                   blocked = true;
+                                   mu.Await(absl::Condition(&released));
+                                 },
+                                 [&]() {
+                                   absl::MutexLock lock(&mu);
+                                   disconnected = true;
+                                 });
+  Site site;
+  CommandSet insert;
+  AnnotatedString::MakeRawInsert(&insert, &site, "a", AnnotatedString::Begin(),
+                                 AnnotatedString::End());
+  buffer->PushChanges(&insert, true);
+  {
+    absl::MutexLock lock(&mu);
+    mu.Await(absl::Condition(&blocked));
+  }
+  // everything from here queues up behind the delivery that's stuck
+  for (int i = 0; i < 100; i++) {
+    CommandSet commands;
+    Attribute attr;
+    attr.mutable_tags()->add_tags("tag");
+    AnnotatedString::MakeDecl(&commands, &site, attr);
+    buffer->PushChanges(&commands, false);
+  }
+  absl::MutexLock lock(&mu);
+  EXPECT_TRUE(
+      mu.AwaitWithTimeout(absl::Condition(&disconnected), absl::Seconds(10)));
+  released = true;
+  FLAGS_listener_max_queued_bytes = max_queued_bytes;
+}
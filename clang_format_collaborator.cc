@@ -95,7 +95,8 @@ EditResponse ClangFormatCollaborator::Edit(
   return response;
 }
 
-SERVER_COLLABORATOR(ClangFormatCollaborator, buffer) {
+LAZY_SERVER_COLLABORATOR(ClangFormatCollaborator,
+                         kStartOnListener | kStartOnLoaded, buffer) {
   auto fext = buffer->filename().extension();
   for (auto mext : {".c", ".cxx", ".cpp", ".C", ".cc", ".h", ".H", ".hpp",
                     ".hxx", ".proto", ".js", ".java", ".m"}) {
@@ -14,17 +14,27 @@
 
 #include "client.h"
 #include <grpc++/create_channel.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
+#include <deque>
+#include <limits>
+#include <thread>
 #include "absl/time/clock.h"
 #include "log.h"
 #include "project.h"
 #include "server.h"
+#include "shm_channel.h"
 #include "src_hash.h"
 
 DEFINE_bool(check_server_version, false,
             "Check the version of the server is the same as the client "
             "version, quit it otherwise");
 DEFINE_bool(restart_server, false, "Force the server to restart");
+DEFINE_bool(edit_shared_memory, false,
+            "Exchange edits with the (same-host) server through shared "
+            "memory rather than over the gRPC stream");
+DEFINE_int32(edit_shm_ring_bytes, 1 << 20,
+             "Size of each direction's ring for shared memory edit sessions");
 
 Client::Client(const boost::filesystem::path& ced_bin,
                const boost::filesystem::path& path) {
@@ -45,19 +55,9 @@ Client::Client(const boost::filesystem::path& ced_bin,
   for (int attempt = 1; attempt <= 3; attempt++) {
     if (!port_exists()) {
       force_restart = false;
-      SpawnServer(ced_bin, project);
-      int a = 1, b = 1;
-      while (!port_exists()) {
-        auto timeout = absl::Milliseconds(a);
-        if (timeout > absl::Seconds(2)) {
-          throw std::runtime_error("Failed starting server");
-        }
-        Log() << "Sleeping for " << timeout << " while waiting for server @ "
-              << root->LocalAddress();
-        absl::SleepFor(timeout);
-        int c = a + b;
-        b = a;
-        a = c;
+      // it may have lost a race with a standby taking over, which is as good
+      if (!SpawnServer(ced_bin, project) && !port_exists()) {
+        throw std::runtime_error("Failed starting server");
       }
     }
     auto channel = grpc::CreateChannel(root->LocalAddress(),
@@ -98,45 +98,192 @@ Client::Client(const boost::filesystem::path& ced_bin,
 
 namespace {
 
+// An edit stream whose messages after the greeting travel through shared
+// memory. The gRPC stream stays open: ending it ends the session, and its
+// failure fails this stream.
+class SharedMemoryEditStream
+    : public grpc::ClientReaderWriterInterface<EditMessage, EditMessage> {
+ public:
+  SharedMemoryEditStream(grpc::ClientContext* context, EditStreamPtr stream,
+                         std::unique_ptr<SharedMemoryChannel> channel)
+      : context_(context),
+        stream_(std::move(stream)),
+        channel_(std::move(channel)) {
+    // the server sends nothing more on the stream: this read ends with it
+    watcher_ = std::thread([this]() {
+      EditMessage msg;
+      while (stream_->Read(&msg)) {
+      }
+      channel_->Close();
+    });
+  }
+
+  ~SharedMemoryEditStream() {
+    if (watcher_.joinable()) {
+      context_->TryCancel();
+      watcher_.join();
+    }
+  }
+
+  void WaitForInitialMetadata() override { stream_->WaitForInitialMetadata(); }
+
+  bool NextMessageSize(uint32_t* sz) override {
+    *sz = std::numeric_limits<uint32_t>::max();
+    return true;
+  }
+
+  bool Read(EditMessage* msg) override {
+    std::string frame;
+    return channel_->Read(&frame) && msg->ParseFromString(frame);
+  }
+
+  bool Write(const EditMessage& msg, grpc::WriteOptions options) override {
+    return channel_->Write({msg.SerializeAsString()});
+  }
+
+  bool WritesDone() override { return stream_->WritesDone(); }
+
+  grpc::Status Finish() override {
+    watcher_.join();
+    return stream_->Finish();
+  }
+
+ private:
+  grpc::ClientContext* const context_;
+  EditStreamPtr stream_;
+  std::unique_ptr<SharedMemoryChannel> channel_;
+  std::thread watcher_;
+};
+
+// Carries a buffer's edits to and from the server. If the stream drops, the
+// session is resumed on a new one: the server replays what we missed
+// according to our version vector, and we resend what it never received.
 class ClientCollaborator : public AsyncCommandCollaborator {
  public:
-  ClientCollaborator(const Buffer* buffer, EditStreamPtr stream,
-                     std::unique_ptr<grpc::ClientContext> context)
+  ClientCollaborator(const Buffer* buffer, Client* client,
+                     EditStreamPtr stream,
+                     std::unique_ptr<grpc::ClientContext> context,
+                     const EditMessage::ServerHello& hello)
       : AsyncCommandCollaborator("client", absl::Seconds(0), absl::Seconds(0)),
+        client_(client),
+        filename_(buffer->filename()),
+        site_id_(hello.site_id()),
+        epoch_(hello.epoch()),
         context_(std::move(context)),
-        stream_(std::move(stream)) {}
+        stream_(std::move(stream)) {
+    absl::MutexLock lock(&mu_);
+    Acknowledge(VersionVectorFromProto(hello.version()));
+  }
 
   void Push(const CommandSet* commands) {
+    absl::MutexLock lock(&mu_);
     if (commands == nullptr) {
       Log() << "Cancel context";
+      shutdown_ = true;
       context_->TryCancel();
-    } else {
-      EditMessage msg;
-      *msg.mutable_commands() = *commands;
-      stream_->Write(msg);
+      return;
     }
+    if (commands->commands().empty()) return;
+    unacked_.push_back(*commands);
+    EditMessage msg;
+    *msg.mutable_commands() = *commands;
+    // a failed write also fails the next read: Pull then resumes the
+    // session and resends this
+    stream_->Write(msg);
   }
 
   bool Pull(CommandSet* commands) {
     commands->Clear();
     EditMessage msg;
+    grpc::ClientReaderWriterInterface<EditMessage, EditMessage>* stream;
+    {
+      absl::MutexLock lock(&mu_);
+      stream = stream_.get();
+    }
     Log() << "Read";
-    if (!stream_->Read(&msg)) {
+    if (!stream->Read(&msg)) {
       Log() << "Read failed";
-      return false;
+      return Resume(commands);
     }
+    absl::MutexLock lock(&mu_);
     if (msg.type_case() != EditMessage::kCommands) {
       Log() << "Protocol error";
       context_->TryCancel();
       return false;
     }
-    *commands = msg.commands();
+    Acknowledge(VersionVectorFromProto(msg.version()));
+    commands->Swap(msg.mutable_commands());
     return true;
   }
 
  private:
-  std::unique_ptr<grpc::ClientContext> context_;
-  EditStreamPtr stream_;
+  static constexpr int kResumeAttempts = 3;
+
+  // note what the server has seen, and forget those of our own command sets
+  // that it has
+  void Acknowledge(const VersionVector& version) EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    MergeVersionVector(version, &version_);
+    auto it = version_.find(site_id_);
+    const uint64_t received = it == version_.end() ? 0 : it->second;
+    while (acked_ < received && !unacked_.empty()) {
+      unacked_.pop_front();
+      acked_++;
+    }
+  }
+
+  bool Resume(CommandSet* commands) {
+    for (int attempt = 1; attempt <= kResumeAttempts; attempt++) {
+      EditMessage::Resume resume;
+      {
+        absl::MutexLock lock(&mu_);
+        if (shutdown_) return false;
+        resume.set_epoch(epoch_);
+        resume.set_site_id(site_id_);
+        *resume.mutable_version() = VersionVectorToProto(version_);
+      }
+      std::unique_ptr<grpc::ClientContext> context(new grpc::ClientContext());
+      auto stream_and_hello =
+          client_->MakeEditStream(context.get(), filename_, &resume);
+      if (!stream_and_hello.first) {
+        absl::SleepFor(absl::Milliseconds(100 * attempt));
+        continue;
+      }
+      const auto& hello = stream_and_hello.second.server_hello();
+      absl::MutexLock lock(&mu_);
+      if (shutdown_) return false;
+      // the old stream refers to the old context: destroy it first
+      stream_ = std::move(stream_and_hello.first);
+      context_ = std::move(context);
+      Acknowledge(VersionVectorFromProto(hello.version()));
+      for (const auto& unacked : unacked_) {
+        EditMessage msg;
+        *msg.mutable_commands() = unacked;
+        stream_->Write(msg);
+      }
+      *commands = hello.missed();
+      Log() << "Resumed edit session on " << filename_ << ": "
+            << commands->commands_size() << " commands missed, "
+            << unacked_.size() << " sets resent";
+      return true;
+    }
+    Log() << "Unable to resume edit session on " << filename_;
+    return false;
+  }
+
+  Client* const client_;
+  const boost::filesystem::path filename_;
+  const int site_id_;
+  const uint64_t epoch_;
+  absl::Mutex mu_;
+  std::unique_ptr<grpc::ClientContext> context_ GUARDED_BY(mu_);
+  EditStreamPtr stream_ GUARDED_BY(mu_);
+  bool shutdown_ GUARDED_BY(mu_) = false;
+  // command sets seen, per originating site
+  VersionVector version_ GUARDED_BY(mu_);
+  // our command sets not yet known to have reached the server, and how many
+  // before them have
+  std::deque<CommandSet> unacked_ GUARDED_BY(mu_);
+  uint64_t acked_ GUARDED_BY(mu_) = 0;
 };
 
 }  // namespace
@@ -147,27 +294,59 @@ std::unique_ptr<Buffer> Client::MakeBuffer(
   std::pair<EditStreamPtr, EditMessage> stream_and_first_msg =
       MakeEditStream(ctx.get(), path);
   if (!stream_and_first_msg.first) return nullptr;
+  // the content follows the hello as ordinary commands
   auto buffer =
       Buffer::Builder()
           .SetFilename(path)
-          .SetInitialString(AnnotatedString::FromProto(
-              stream_and_first_msg.second.server_hello().current_state()))
           .SetSiteID(stream_and_first_msg.second.server_hello().site_id())
           .Make();
   buffer->MakeCollaborator<ClientCollaborator>(
-      std::move(stream_and_first_msg.first), std::move(ctx));
+      this, std::move(stream_and_first_msg.first), std::move(ctx),
+      stream_and_first_msg.second.server_hello());
   return buffer;
 }
 
+ProfileResponse Client::Profile(const boost::filesystem::path& path) {
+  ProfileRequest req;
+  ProfileResponse rsp;
+  if (!path.empty()) req.set_buffer_name(path.string());
+  grpc::ClientContext ctx;
+  auto status = project_stub_->Profile(&ctx, req, &rsp);
+  if (!status.ok()) {
+    throw std::runtime_error(
+        absl::StrCat("Profile failed: ", status.error_message()));
+  }
+  return rsp;
+}
+
 std::pair<EditStreamPtr, EditMessage> Client::MakeEditStream(
-    grpc::ClientContext* ctx, const boost::filesystem::path& path) {
+    grpc::ClientContext* ctx, const boost::filesystem::path& path,
+    const EditMessage::Resume* resume) {
   EditStreamPtr stream = project_stub_->Edit(ctx);
   EditMessage hello;
   hello.mutable_client_hello()->set_buffer_name(path.string());
+  if (resume) *hello.mutable_client_hello()->mutable_resume() = *resume;
+  std::unique_ptr<SharedMemoryChannel> channel;
+  if (FLAGS_edit_shared_memory) {
+    channel = SharedMemoryChannel::Create(FLAGS_edit_shm_ring_bytes);
+  }
+  if (channel) {
+    auto offer = hello.mutable_client_hello()->mutable_shared_memory();
+    offer->set_pid(getpid());
+    offer->set_fd(channel->fd());
+    offer->set_ring_bytes(channel->ring_bytes());
+    offer->set_token(channel->token());
+  }
   stream->Write(hello);
   if (!stream->Read(&hello)) return std::pair<EditStreamPtr, EditMessage>();
   if (hello.type_case() != EditMessage::kServerHello) {
     return std::pair<EditStreamPtr, EditMessage>();
   }
+  if (channel && hello.server_hello().shared_memory()) {
+    // the server has the channel mapped by now
+    channel->CloseFd();
+    stream.reset(new SharedMemoryEditStream(ctx, std::move(stream),
+                                            std::move(channel)));
+  }
   return std::make_pair(std::move(stream), hello);
 }
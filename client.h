@@ -27,8 +27,14 @@ class Client {
          const boost::filesystem::path& project_root_hint);
 
   std::unique_ptr<Buffer> MakeBuffer(const boost::filesystem::path& path);
+  // resume (if set) picks up a dropped session: see EditMessage.Resume
   std::pair<EditStreamPtr, EditMessage> MakeEditStream(
-      grpc::ClientContext* ctx, const boost::filesystem::path& path);
+      grpc::ClientContext* ctx, const boost::filesystem::path& path,
+      const EditMessage::Resume* resume = nullptr);
+
+  // fetch collaborator latency histograms for one (or, given an empty path,
+  // every) buffer open on the server
+  ProfileResponse Profile(const boost::filesystem::path& path);
 
  private:
   std::unique_ptr<ProjectService::Stub> project_stub_;
@@ -24,7 +24,8 @@ DEFINE_bool(buffer_profile_display, false,
 
 DEFINE_bool(editor_debug_display, false, "Show editor debug information");
 
-absl::Mutex ClientCollaborator::mu_;
+absl::Mutex ClientCollaborator::all_mu_;
+int ClientCollaborator::all_renders_ = 0;
 std::vector<ClientCollaborator*> ClientCollaborator::all_;
 
 absl::Mutex Invalidator::mu_;
@@ -53,18 +54,33 @@ ClientCollaborator::ClientCollaborator(const Buffer* buffer)
       editor_(Editor::Make(buffer_->site(), buffer_->filename().string(),
                            !buffer->synthetic())),
       recently_used_(false) {
-  absl::MutexLock lock(&mu_);
+  absl::MutexLock lock(&all_mu_);
   all_.push_back(this);
 }
 
 ClientCollaborator::~ClientCollaborator() {
-  absl::MutexLock lock(&mu_);
+  auto not_rendering = []() {
+    all_mu_.AssertHeld();
+    return all_renders_ == 0;
+  };
+  absl::MutexLock lock(&all_mu_);
   all_.erase(std::remove(all_.begin(), all_.end(), this), all_.end());
+  // a render that started before we left may still be drawing us
+  all_mu_.Await(absl::Condition(&not_rendering));
 }
 
 void ClientCollaborator::All_Render(RenderContainers containers, Theme* theme) {
-  absl::MutexLock lock(&mu_);
-  for (auto t : all_) t->Render(containers, theme);
+  // each editor is locked without all_mu_ held, so that one busy editor
+  // holds up neither the others' rendering nor editors coming and going
+  std::vector<ClientCollaborator*> all;
+  {
+    absl::MutexLock lock(&all_mu_);
+    all = all_;
+    all_renders_++;
+  }
+  for (auto t : all) t->Render(containers, theme);
+  absl::MutexLock lock(&all_mu_);
+  all_renders_--;
 }
 
 void ClientCollaborator::Push(const EditNotification& notification) {
@@ -86,6 +102,16 @@ EditResponse ClientCollaborator::Pull() {
 
   mu_.LockWhen(absl::Condition(&ready));
   LogTimer tmr("term_pull");
+  // rendering the focused editor waits for mu_: a paste's chunks are
+  // inserted without it
+  Editor::PasteChunk chunk;
+  if (editor_->TakePasteChunk(&chunk)) {
+    mu_.Unlock();
+    chunk.Insert();
+    tmr.Mark("paste");
+    mu_.Lock();
+    editor_->PutPasteChunk(&chunk);
+  }
   EditResponse r = editor_->MakeResponse();
   tmr.Mark("make");
   r.become_used |= recently_used_;
@@ -102,18 +128,31 @@ void ClientCollaborator::Render(RenderContainers containers, Theme* theme) {
   /*
    * edit item
    */
-  editor_->Render(theme,
-                  buffer_->synthetic() ? containers.side_bar : containers.main);
+  Widget* parent = buffer_->synthetic() ? containers.side_bar : containers.main;
+  // while a collaborator thread holds the editor, draw its last frame rather
+  // than wait: unless it has the focus, and so this frame's key presses
+  bool locked = true;
+  if (frame_ != nullptr && !frame_->focused) {
+    locked = mu_.TryLock();
+  } else {
+    mu_.Lock();
+  }
+  if (!locked) {
+    Editor::RenderFrame(*frame_, theme, parent);
+  } else {
+    frame_ = editor_->Render(theme, parent);
+  }
 
   if (FLAGS_buffer_profile_display) {
     containers.side_bar->MakeSimpleText(theme->ThemeToken({}, 0),
                                         buffer_->ProfileData());
   }
 
-  if (FLAGS_editor_debug_display) {
+  if (locked && FLAGS_editor_debug_display) {
     containers.side_bar->MakeSimpleText(theme->ThemeToken({}, 0),
                                         editor_->DebugData());
   }
+  if (locked) mu_.Unlock();
 
 #if 0
   side_bar.AddItem(LAY_FILL, [this](TerminalRenderContext* context) {
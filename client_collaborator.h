@@ -17,7 +17,6 @@
 #include "absl/time/time.h"
 #include "buffer.h"
 #include "editor.h"
-#include "line_editor.h"
 #include "log.h"
 #include "render.h"
 
@@ -49,14 +48,19 @@ class ClientCollaborator final : public AsyncCollaborator {
   static void All_Render(RenderContainers containers, Theme* theme);
 
  private:
-  void Render(RenderContainers containers, Theme* theme)
-      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void Render(RenderContainers containers, Theme* theme);
 
   const Buffer* const buffer_;
-  static absl::Mutex mu_;
+  // each editor's own: a slow update to one buffer holds up only that one
+  absl::Mutex mu_;
   std::shared_ptr<Editor> editor_ GUARDED_BY(mu_);
-  LineEditor find_editor_ GUARDED_BY(mu_);
   bool recently_used_ GUARDED_BY(mu_);
+  // the editor's last frame, drawn again while another thread holds mu_;
+  // only the render thread touches it
+  std::shared_ptr<const Editor::Frame> frame_;
 
-  static std::vector<ClientCollaborator*> all_ GUARDED_BY(mu_);
+  static absl::Mutex all_mu_;
+  static std::vector<ClientCollaborator*> all_ GUARDED_BY(all_mu_);
+  // All_Render calls under way: see ~ClientCollaborator
+  static int all_renders_ GUARDED_BY(all_mu_);
 };
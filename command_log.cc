@@ -0,0 +1,67 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "command_log.h"
+#include <algorithm>
+
+VersionVectorMsg VersionVectorToProto(const VersionVector& version) {
+  VersionVectorMsg msg;
+  for (const auto& v : version) {
+    (*msg.mutable_sets())[v.first] = v.second;
+  }
+  return msg;
+}
+
+VersionVector VersionVectorFromProto(const VersionVectorMsg& msg) {
+  VersionVector version;
+  for (const auto& v : msg.sets()) {
+    version[v.first] = v.second;
+  }
+  return version;
+}
+
+void MergeVersionVector(const VersionVector& from, VersionVector* into) {
+  for (const auto& v : from) {
+    uint64_t& seq = (*into)[v.first];
+    seq = std::max(seq, v.second);
+  }
+}
+
+const VersionVector& CommandLog::Append(int origin,
+                                        const CommandSet& commands) {
+  const size_t bytes = commands.ByteSizeLong();
+  entries_.push_back(Entry{origin, ++version_[origin], bytes, commands});
+  bytes_ += bytes;
+  // always keep the newest entry, however large
+  while (bytes_ > max_bytes_ && entries_.size() > 1) {
+    const Entry& e = entries_.front();
+    dropped_[e.origin] = e.seq;
+    bytes_ -= e.bytes;
+    entries_.pop_front();
+  }
+  return version_;
+}
+
+bool CommandLog::Since(const VersionVector& since, CommandSet* out) const {
+  auto seen = [&since](int origin) -> uint64_t {
+    auto it = since.find(origin);
+    return it == since.end() ? 0 : it->second;
+  };
+  for (const auto& d : dropped_) {
+    if (d.second > seen(d.first)) return false;
+  }
+  for (const auto& e : entries_) {
+    if (e.seq > seen(e.origin)) out->MergeFrom(e.commands);
+  }
+  return true;
+}
@@ -0,0 +1,61 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include "proto/annotation.pb.h"
+
+// Per originating site, the number of command sets seen from it.
+// Deletions reuse the ID of what they delete, so ID clocks alone can't say
+// whether a peer has seen one: sets are counted instead.
+typedef std::map<int, uint64_t> VersionVector;
+
+VersionVectorMsg VersionVectorToProto(const VersionVector& version);
+VersionVector VersionVectorFromProto(const VersionVectorMsg& msg);
+// raise each of into's components to at least from's
+void MergeVersionVector(const VersionVector& from, VersionVector* into);
+
+// Bounded, ordered history of the command sets published on a buffer, from
+// which a peer that knows how far it got can be brought up to date.
+class CommandLog {
+ public:
+  explicit CommandLog(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  // record commands from origin; returns the version after them
+  const VersionVector& Append(int origin, const CommandSet& commands);
+
+  // collect, in order, every set after since; false if some of them have
+  // already been dropped
+  bool Since(const VersionVector& since, CommandSet* out) const;
+
+  const VersionVector& version() const { return version_; }
+  size_t bytes() const { return bytes_; }
+
+ private:
+  struct Entry {
+    int origin;
+    uint64_t seq;
+    size_t bytes;
+    CommandSet commands;
+  };
+
+  const size_t max_bytes_;
+  size_t bytes_ = 0;
+  std::deque<Entry> entries_;
+  VersionVector version_;
+  // per origin, the last sequence number no longer held
+  VersionVector dropped_;
+};
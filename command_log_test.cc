@@ -0,0 +1,70 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "command_log.h"
+#include <gtest/gtest.h>
+
+namespace {
+
+CommandSet Delete(uint64_t id) {
+  CommandSet commands;
+  auto* cmd = commands.add_commands();
+  cmd->set_id(id);
+  cmd->mutable_delete_();
+  return commands;
+}
+
+}  // namespace
+
+TEST(CommandLogTest, Since) {
+  CommandLog log(1 << 20);
+  log.Append(1, Delete(10));
+  VersionVector mid = log.Append(2, Delete(20));
+  log.Append(1, Delete(11));
+  log.Append(3, Delete(30));
+  EXPECT_EQ(2, log.version().at(1));
+  EXPECT_EQ(1, log.version().at(2));
+
+  CommandSet out;
+  ASSERT_TRUE(log.Since(mid, &out));
+  ASSERT_EQ(2, out.commands_size());
+  EXPECT_EQ(11, out.commands(0).id());
+  EXPECT_EQ(30, out.commands(1).id());
+
+  out.Clear();
+  ASSERT_TRUE(log.Since(VersionVector(), &out));
+  EXPECT_EQ(4, out.commands_size());
+}
+
+TEST(CommandLogTest, Truncated) {
+  const size_t entry_bytes = Delete(10).ByteSizeLong();
+  CommandLog log(2 * entry_bytes);
+  log.Append(1, Delete(10));
+  VersionVector after_first = log.version();
+  log.Append(1, Delete(11));
+  log.Append(2, Delete(20));
+  EXPECT_EQ(2 * entry_bytes, log.bytes());
+
+  CommandSet out;
+  EXPECT_FALSE(log.Since(VersionVector(), &out));
+  ASSERT_TRUE(log.Since(after_first, &out));
+  EXPECT_EQ(2, out.commands_size());
+}
+
+TEST(CommandLogTest, Proto) {
+  VersionVector v{{1, 5}, {7, 2}};
+  EXPECT_EQ(v, VersionVectorFromProto(VersionVectorToProto(v)));
+  VersionVector w{{1, 3}, {2, 9}};
+  MergeVersionVector(w, &v);
+  EXPECT_EQ((VersionVector{{1, 5}, {2, 9}, {7, 2}}), v);
+}
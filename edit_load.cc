@@ -0,0 +1,690 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <gflags/gflags.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include "absl/strings/str_replace.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "application.h"
+#include "client.h"
+#include "histogram.h"
+
+DEFINE_int32(edit_load_streams, 256,
+             "Number of concurrent edit streams EditLoad opens");
+DEFINE_int32(edit_load_timeout_s, 30,
+             "How long EditLoad waits for the server before giving up");
+DEFINE_int32(edit_latency_round_trips, 1000,
+             "Number of round trips EditLatency times");
+DEFINE_int32(edit_replay_clients, 8,
+             "Number of clients EditReplay connects");
+DEFINE_string(edit_replay_trace, "",
+              "Operations for EditReplay to perform, one per line (see "
+              "EditReplay); synthesized if empty");
+DEFINE_int32(edit_replay_ops, 200,
+             "Number of operations EditReplay synthesizes");
+DEFINE_int32(edit_replay_seed, 1,
+             "Seed for the operations EditReplay synthesizes");
+DEFINE_int32(edit_replay_settle_ms, 5000,
+             "How long EditReplay waits for an operation to reach every "
+             "client");
+DEFINE_int32(edit_replay_annotate_ms, 1000,
+             "How long EditReplay waits after each operation for the "
+             "server's collaborators to annotate it; 0 to not wait");
+
+namespace {
+
+constexpr const char* kTag = "edit_load";
+
+boost::filesystem::path PathFromCmdLine(int argc, char** argv) {
+  if (argc != 2) {
+    throw std::runtime_error("Expected a filename");
+  }
+  return argv[1];
+}
+
+// a message declaring a tagged attribute: never marked on the text, so
+// sending one leaves the file untouched
+EditMessage Declare(Site* site) {
+  Attribute attr;
+  attr.mutable_tags()->add_tags(kTag);
+  EditMessage msg;
+  AnnotatedString::MakeDecl(msg.mutable_commands(), site, attr);
+  return msg;
+}
+
+bool HasDeclaration(const EditMessage& msg,
+                    const std::function<bool(const Command&)>& pred) {
+  for (const auto& cmd : msg.commands().commands()) {
+    if (cmd.command_case() == Command::kDecl && pred(cmd)) return true;
+  }
+  return false;
+}
+
+// visible characters in document order, after the beginning of the text:
+// inserting at offset i goes after the i'th
+std::vector<ID> Offsets(const AnnotatedString& content) {
+  std::vector<ID> ids;
+  AnnotatedString::Iterator it(content, AnnotatedString::Begin());
+  while (!it.is_end()) {
+    ids.push_back(it.id());
+    it.MoveNext();
+  }
+  return ids;
+}
+
+std::string HistogramJson(const HistogramMsg& h) {
+  return absl::StrCat("{\"n\":", h.count(), ",\"mean\":",
+                      h.count() == 0 ? 0 : h.sum() / h.count(),
+                      ",\"p50\":", HistogramQuantile(h, 0.5),
+                      ",\"p90\":", HistogramQuantile(h, 0.9),
+                      ",\"p99\":", HistogramQuantile(h, 0.99),
+                      ",\"max\":", h.max(), "}");
+}
+
+}  // namespace
+
+// Opens many concurrent edit streams on one file, then has one of them
+// declare an attribute and waits for it to reach all the others: reports
+// how long the server took to greet each stream, and to fan the update out.
+// The attribute is never marked on the text, so the file is left untouched.
+class EditLoad : public Application {
+ public:
+  EditLoad(int argc, char** argv)
+      : path_(PathFromCmdLine(argc, argv)), client_(argv[0], path_) {}
+
+  int Run() override {
+    const int n = FLAGS_edit_load_streams;
+    std::vector<Stream> streams(n);
+    std::vector<std::thread> readers;
+    for (auto& s : streams) {
+      readers.emplace_back([this, &s]() { Read(&s); });
+    }
+
+    const absl::Time deadline =
+        absl::Now() + absl::Seconds(FLAGS_edit_load_timeout_s);
+    bool ok;
+    {
+      absl::MutexLock lock(&mu_);
+      auto all_greeted = [this, n]() {
+        mu_.AssertHeld();
+        return greeted_ + failed_ == n;
+      };
+      ok = mu_.AwaitWithDeadline(absl::Condition(&all_greeted), deadline) &&
+           greeted_ > 0;
+    }
+
+    if (ok) {
+      Stream* sender = nullptr;
+      for (auto& s : streams) {
+        if (s.stream) {
+          sender = &s;
+          break;
+        }
+      }
+      Site site(absl::optional<int>(sender->site_id));
+      EditMessage msg = Declare(&site);
+      {
+        absl::MutexLock lock(&mu_);
+        sent_ = absl::Now();
+      }
+      sender->stream->Write(msg);
+      absl::MutexLock lock(&mu_);
+      auto all_heard = [this]() {
+        mu_.AssertHeld();
+        return heard_ + failed_ >= greeted_ - 1;
+      };
+      if (!mu_.AwaitWithDeadline(absl::Condition(&all_heard), deadline)) {
+        std::cerr << "Timed out with " << heard_ << " of " << greeted_ - 1
+                  << " streams hearing the update\n";
+      }
+    } else {
+      absl::MutexLock lock(&mu_);
+      std::cerr << "Timed out with " << greeted_ << " of " << n
+                << " streams greeted\n";
+    }
+
+    {
+      absl::MutexLock lock(&mu_);
+      for (auto& s : streams) {
+        if (s.stream) {
+          s.stream->WritesDone();
+        } else {
+          s.context.TryCancel();
+        }
+      }
+    }
+    for (auto& r : readers) r.join();
+
+    HistogramMsg hello_us, fanout_us;
+    hello_us_.ToProto(&hello_us);
+    fanout_us_.ToProto(&fanout_us);
+    absl::MutexLock lock(&mu_);
+    std::cout << "streams: " << n << " failed: " << failed_ << "\n"
+              << "hello_us: " << HistogramSummary(hello_us) << "\n"
+              << "fanout_us: " << HistogramSummary(fanout_us) << "\n";
+    return failed_ == 0 ? 0 : 1;
+  }
+
+ private:
+  struct Stream {
+    grpc::ClientContext context;
+    EditStreamPtr stream;
+    int site_id = 0;
+  };
+
+  void Read(Stream* s) {
+    const absl::Time start = absl::Now();
+    auto hello = client_.MakeEditStream(&s->context, path_);
+    if (!hello.first ||
+        hello.second.type_case() != EditMessage::kServerHello) {
+      absl::MutexLock lock(&mu_);
+      failed_++;
+      return;
+    }
+    hello_us_.Add(absl::ToInt64Microseconds(absl::Now() - start));
+    s->site_id = hello.second.server_hello().site_id();
+    {
+      absl::MutexLock lock(&mu_);
+      s->stream = std::move(hello.first);
+      greeted_++;
+    }
+    EditMessage msg;
+    bool heard = false;
+    while (s->stream->Read(&msg)) {
+      if (heard || !IsLoadUpdate(msg)) continue;
+      heard = true;
+      absl::MutexLock lock(&mu_);
+      fanout_us_.Add(absl::ToInt64Microseconds(absl::Now() - sent_));
+      heard_++;
+    }
+    grpc::Status status = s->stream->Finish();
+    if (!status.ok()) {
+      absl::MutexLock lock(&mu_);
+      failed_++;
+    }
+  }
+
+  static bool IsLoadUpdate(const EditMessage& msg) {
+    return HasDeclaration(msg, [](const Command& cmd) {
+      for (const auto& tag : cmd.decl().tags().tags()) {
+        if (tag == kTag) return true;
+      }
+      return false;
+    });
+  }
+
+  const boost::filesystem::path path_;
+  Client client_;
+  Histogram hello_us_;
+  Histogram fanout_us_;
+  absl::Mutex mu_;
+  int greeted_ GUARDED_BY(mu_) = 0;
+  int heard_ GUARDED_BY(mu_) = 0;
+  int failed_ GUARDED_BY(mu_) = 0;
+  absl::Time sent_ GUARDED_BY(mu_);
+};
+
+REGISTER_APPLICATION(EditLoad);
+
+// Times keystroke sized round trips between two edit streams on one file:
+// one declares an attribute, and the other answers with one of its own as
+// soon as it hears of it. Run with and without -edit_shared_memory to
+// compare the transports.
+class EditLatency : public Application {
+ public:
+  EditLatency(int argc, char** argv)
+      : path_(PathFromCmdLine(argc, argv)), client_(argv[0], path_) {}
+
+  int Run() override {
+    grpc::ClientContext ping_context;
+    grpc::ClientContext pong_context;
+    auto ping = client_.MakeEditStream(&ping_context, path_);
+    auto pong = client_.MakeEditStream(&pong_context, path_);
+    if (!ping.first || !pong.first) {
+      std::cerr << "Unable to open edit streams\n";
+      return 1;
+    }
+    Site ping_site(absl::optional<int>(ping.second.server_hello().site_id()));
+    Site pong_site(absl::optional<int>(pong.second.server_hello().site_id()));
+    auto from = [](const Site& site) {
+      return [&site](const Command& cmd) { return site.CreatedID(cmd.id()); };
+    };
+
+    std::thread answer([&]() {
+      EditMessage msg;
+      while (pong.first->Read(&msg)) {
+        if (HasDeclaration(msg, from(ping_site))) {
+          pong.first->Write(Declare(&pong_site));
+        }
+      }
+    });
+
+    Histogram round_trip_us;
+    EditMessage msg;
+    for (int i = 0; i < FLAGS_edit_latency_round_trips; i++) {
+      const absl::Time start = absl::Now();
+      ping.first->Write(Declare(&ping_site));
+      bool answered = false;
+      while (!answered && ping.first->Read(&msg)) {
+        answered = HasDeclaration(msg, from(pong_site));
+      }
+      if (!answered) break;
+      round_trip_us.Add(absl::ToInt64Microseconds(absl::Now() - start));
+    }
+
+    ping.first->WritesDone();
+    pong.first->WritesDone();
+    while (ping.first->Read(&msg)) {
+    }
+    ping.first->Finish();
+    answer.join();
+    pong.first->Finish();
+
+    HistogramMsg summary;
+    round_trip_us.ToProto(&summary);
+    std::cout << "round_trip_us: " << HistogramSummary(summary) << "\n";
+    const bool complete =
+        summary.count() ==
+        static_cast<uint64_t>(FLAGS_edit_latency_round_trips);
+    return complete ? 0 : 1;
+  }
+
+ private:
+  const boost::filesystem::path path_;
+  Client client_;
+};
+
+REGISTER_APPLICATION(EditLatency);
+
+// Connects many clients to one file and replays a trace of edits through
+// them, one operation at a time, reporting as JSON lines how long each kind
+// of operation took to reach the other clients (fanout_us) and for the
+// server's collaborators to annotate the result (annotate_us), and what the
+// server spent doing it. Traces have one operation per line:
+//   type <client> <text>    types text at the client's cursor, a character
+//                           per message
+//   paste <client> <text>   inserts text at the client's cursor at once
+//   move <client> <offset>  moves the client's cursor
+//   conflict <text>         every client inserts text at client 0's cursor
+// with newlines in text written as \n.
+// Without a trace, -edit_replay_ops random ones are synthesized. Every
+// character inserted is deleted again at the end, so the file is left as it
+// was.
+class EditReplay : public Application {
+ public:
+  EditReplay(int argc, char** argv)
+      : path_(PathFromCmdLine(argc, argv)),
+        client_(argv[0], path_),
+        rng_(FLAGS_edit_replay_seed) {}
+
+  int Run() override {
+    const absl::Time start = absl::Now();
+    const ProfileResponse::Process before = client_.Profile(path_).process();
+    std::vector<std::unique_ptr<Replica>> replicas;
+    for (int i = 0; i < FLAGS_edit_replay_clients; i++) {
+      std::unique_ptr<Replica> r(new Replica);
+      auto hello = client_.MakeEditStream(&r->context, path_);
+      if (!hello.first) {
+        std::cerr << "Unable to open edit stream " << i << "\n";
+        return 1;
+      }
+      r->site.reset(
+          new Site(absl::optional<int>(hello.second.server_hello().site_id())));
+      r->stream = std::move(hello.first);
+      replicas.emplace_back(std::move(r));
+    }
+    {
+      absl::MutexLock lock(&mu_);
+      for (const auto& r : replicas) sites_.insert(r->site->site_id());
+    }
+    for (auto& r : replicas) {
+      Replica* p = r.get();
+      readers_.emplace_back([this, p]() { Read(p); });
+    }
+    replicas_ = &replicas;
+
+    // the initial state precedes anything else on each stream: once a
+    // declaration has reached every client, all of them have it
+    bool ok = Perform(nullptr, [this](Replica* r) {
+      Attribute attr;
+      attr.mutable_tags()->add_tags(kTag);
+      AnnotatedString::MakeDecl(&r->out, r->site.get(), attr);
+    }, 0);
+
+    std::vector<std::string> trace;
+    if (!FLAGS_edit_replay_trace.empty()) {
+      std::ifstream in(FLAGS_edit_replay_trace);
+      std::string line;
+      while (std::getline(in, line)) {
+        if (!line.empty()) trace.push_back(line);
+      }
+    }
+    const size_t ops =
+        trace.empty() ? FLAGS_edit_replay_ops : trace.size();
+    for (size_t i = 0; ok && i < ops; i++) {
+      ok = Replay(trace.empty() ? Synthesize() : trace[i]);
+    }
+
+    // clean up after ourselves: our characters, and our cursors
+    const bool restored = ok && Perform(nullptr, [this](Replica* r) {
+      mu_.AssertHeld();
+      for (ID id : Offsets(r->content)) {
+        if (sites_.count(id.site)) AnnotatedString::MakeDelete(&r->out, id);
+      }
+      for (const auto& other : *replicas_) {
+        if (other->cursor_mark != ID()) {
+          AnnotatedString::MakeDelMark(&r->out, other->cursor_mark);
+        }
+      }
+    }, 0);
+
+    bool converged = true;
+    {
+      absl::MutexLock lock(&mu_);
+      const std::string text = replicas.front()->content.Render();
+      for (const auto& r : replicas) {
+        converged = converged && r->content.Render() == text;
+      }
+    }
+    for (auto& r : replicas) r->stream->WritesDone();
+    for (auto& t : readers_) t.join();
+    for (auto& r : replicas) r->stream->Finish();
+
+    const ProfileResponse::Process after = client_.Profile(path_).process();
+    for (const auto& k : stats_) {
+      HistogramMsg fanout_us, annotate_us;
+      k.second->fanout_us.ToProto(&fanout_us);
+      k.second->annotate_us.ToProto(&annotate_us);
+      std::cout << "{\"kind\":\"" << k.first << "\",\"ops\":" << k.second->ops
+                << ",\"fanout_us\":" << HistogramJson(fanout_us)
+                << ",\"annotate_us\":" << HistogramJson(annotate_us)
+                << ",\"unannotated\":" << k.second->unannotated << "}\n";
+    }
+    std::cout << "{\"kind\":\"total\",\"clients\":" << replicas.size()
+              << ",\"ops\":" << ops << ",\"completed\":" << ok
+              << ",\"restored\":" << restored
+              << ",\"converged\":" << converged << ",\"elapsed_us\":"
+              << absl::ToInt64Microseconds(absl::Now() - start)
+              << ",\"server_user_cpu_us\":"
+              << after.user_cpu_us() - before.user_cpu_us()
+              << ",\"server_system_cpu_us\":"
+              << after.system_cpu_us() - before.system_cpu_us()
+              << ",\"server_max_rss_bytes\":" << after.max_rss_bytes()
+              << ",\"server_buffer_bytes\":" << after.buffer_bytes() << "}\n";
+    return ok && restored && converged ? 0 : 1;
+  }
+
+ private:
+  struct Stats {
+    Histogram fanout_us;
+    Histogram annotate_us;
+    uint64_t ops = 0;
+    uint64_t unannotated = 0;
+  };
+
+  // a client, and its copy of the buffer (under mu_)
+  struct Replica {
+    grpc::ClientContext context;
+    EditStreamPtr stream;
+    std::unique_ptr<Site> site;
+    AnnotatedString content;
+    // where the client types: after this character
+    ID cursor = AnnotatedString::Begin();
+    ID cursor_attr;
+    ID cursor_mark;
+    // commands being built by the current operation
+    CommandSet out;
+  };
+
+  // an operation's message, until every other client has seen it
+  struct Pending {
+    Stats* stats;
+    absl::Time sent;
+    size_t unseen;
+  };
+
+  std::string Synthesize() {
+    const int client = rng_() % replicas_->size();
+    auto word = [this]() {
+      std::string w;
+      for (int n = 1 + rng_() % 8; n > 0; n--) w += 'a' + rng_() % 26;
+      return w + (rng_() % 8 == 0 ? "\\n" : " ");
+    };
+    const int dice = rng_() % 20;
+    if (dice < 10) return absl::StrCat("type ", client, " ", word());
+    if (dice < 15) {
+      size_t length;
+      {
+        absl::MutexLock lock(&mu_);
+        length = Offsets((*replicas_)[client]->content).size();
+      }
+      return absl::StrCat("move ", client, " ", rng_() % (length + 1));
+    }
+    if (dice < 18) {
+      std::string text;
+      for (int n = 1 + rng_() % 64; n > 0; n--) text += word();
+      return absl::StrCat("paste ", client, " ", text);
+    }
+    return absl::StrCat("conflict ", word());
+  }
+
+  bool Replay(const std::string& op) {
+    std::istringstream in(op);
+    std::string kind;
+    in >> kind;
+    auto rest = [&in]() {
+      std::string text;
+      in.get();
+      std::getline(in, text);
+      return absl::StrReplaceAll(text, {{"\\n", "\n"}});
+    };
+    if (kind == "conflict") {
+      const std::string text = rest();
+      return Perform(Kind(kind), [this, text](Replica* r) {
+        mu_.AssertHeld();
+        // the others' cursors are where client 0's is in their copies
+        const auto offsets = Offsets(r->content);
+        const auto first = Offsets((*replicas_)[0]->content);
+        auto it = std::find(first.begin(), first.end(),
+                            (*replicas_)[0]->cursor);
+        const ID after = it == first.end()
+                             ? AnnotatedString::Begin()
+                             : offsets[std::min<size_t>(
+                                   it - first.begin(), offsets.size() - 1)];
+        r->cursor = r->content.MakeInsert(&r->out, r->site.get(), text, after);
+      }, -1);
+    }
+    int client;
+    in >> client;
+    if (!in || client < 0 || client >= static_cast<int>(replicas_->size())) {
+      std::cerr << "Bad operation: " << op << "\n";
+      return false;
+    }
+    if (kind == "move") {
+      size_t offset;
+      in >> offset;
+      return Perform(Kind(kind), [this, offset](Replica* r) {
+        mu_.AssertHeld();
+        const auto offsets = Offsets(r->content);
+        r->cursor = offset == 0 || offsets.empty()
+                        ? AnnotatedString::Begin()
+                        : offsets[std::min(offset, offsets.size()) - 1];
+        if (r->cursor_mark != ID()) {
+          AnnotatedString::MakeDelMark(&r->out, r->cursor_mark);
+        }
+        if (r->cursor_attr == ID()) {
+          Attribute attr;
+          attr.mutable_cursor();
+          r->cursor_attr =
+              AnnotatedString::MakeDecl(&r->out, r->site.get(), attr);
+        }
+        Annotation anno;
+        anno.set_begin(r->cursor.id);
+        anno.set_end(
+            AnnotatedString::Iterator(r->content, r->cursor).Next().id().id);
+        anno.set_attribute(r->cursor_attr.id);
+        r->cursor_mark =
+            AnnotatedString::MakeMark(&r->out, r->site.get(), anno);
+      }, client);
+    }
+    const std::string text = rest();
+    if (kind == "paste") {
+      return Perform(Kind(kind), [this, text](Replica* r) {
+        r->cursor =
+            r->content.MakeInsert(&r->out, r->site.get(), text, r->cursor);
+      }, client);
+    }
+    if (kind == "type") {
+      // a message per keystroke, sent without waiting for the last
+      for (size_t i = 0; i + 1 < text.size(); i++) {
+        if (!Perform(Kind(kind), [this, c = text[i]](Replica* r) {
+              r->cursor = r->content.MakeInsert(&r->out, r->site.get(),
+                                                std::string(1, c), r->cursor);
+            }, client, false)) {
+          return false;
+        }
+      }
+      return text.empty() ||
+             Perform(Kind(kind), [this, c = text.back()](Replica* r) {
+               r->cursor = r->content.MakeInsert(&r->out, r->site.get(),
+                                                 std::string(1, c), r->cursor);
+             }, client);
+    }
+    std::cerr << "Bad operation: " << op << "\n";
+    return false;
+  }
+
+  Stats* Kind(const std::string& kind) {
+    auto& stats = stats_[kind];
+    if (!stats) stats.reset(new Stats);
+    return stats.get();
+  }
+
+  // has client (or with -1, every client) build commands with edit (which
+  // mustn't integrate them) and send them; unless settle is false, then
+  // waits for them to reach the others, and for the server to annotate the
+  // result; stats (if set) gets the timings
+  bool Perform(Stats* stats, std::function<void(Replica*)> edit, int client,
+               bool settle = true) {
+    std::vector<Replica*> writers;
+    for (size_t i = 0; i < replicas_->size(); i++) {
+      if (client < 0 || static_cast<int>(i) == client) {
+        writers.push_back((*replicas_)[i].get());
+      }
+    }
+    std::vector<EditMessage> msgs(writers.size());
+    {
+      absl::MutexLock lock(&mu_);
+      for (size_t i = 0; i < writers.size(); i++) {
+        Replica* r = writers[i];
+        r->out.Clear();
+        edit(r);
+        if (r->out.commands().empty()) continue;
+        // the server doesn't echo our own commands back
+        r->content = r->content.Integrate(r->out);
+        msgs[i].mutable_commands()->Swap(&r->out);
+      }
+      const absl::Time now = absl::Now();
+      if (stats) {
+        stats->ops++;
+        awaiting_annotation_ = stats;
+        annotation_since_ = now;
+      }
+      for (const auto& msg : msgs) {
+        if (msg.commands().commands().empty()) continue;
+        pending_[msg.commands().commands(0).id()] =
+            Pending{stats, now, replicas_->size() - 1};
+      }
+    }
+    for (size_t i = 0; i < writers.size(); i++) {
+      if (msgs[i].commands().commands().empty()) continue;
+      if (!writers[i]->stream->Write(msgs[i])) return false;
+    }
+    if (!settle) return true;
+
+    absl::MutexLock lock(&mu_);
+    auto seen = [this]() {
+      mu_.AssertHeld();
+      return pending_.empty();
+    };
+    const auto settle_timeout = absl::Milliseconds(FLAGS_edit_replay_settle_ms);
+    if (!mu_.AwaitWithTimeout(absl::Condition(&seen), settle_timeout)) {
+      std::cerr << "Timed out waiting for " << pending_.size()
+                << " messages to reach every client\n";
+      return false;
+    }
+    auto annotated = [this]() {
+      mu_.AssertHeld();
+      return awaiting_annotation_ == nullptr;
+    };
+    if (stats &&
+        !mu_.AwaitWithTimeout(
+            absl::Condition(&annotated),
+            absl::Milliseconds(FLAGS_edit_replay_annotate_ms))) {
+      stats->unannotated++;
+    }
+    awaiting_annotation_ = nullptr;
+    return true;
+  }
+
+  void Read(Replica* r) {
+    EditMessage msg;
+    while (r->stream->Read(&msg)) {
+      const absl::Time now = absl::Now();
+      absl::MutexLock lock(&mu_);
+      r->content = r->content.Integrate(msg.commands());
+      for (const auto& cmd : msg.commands().commands()) {
+        auto it = pending_.find(cmd.id());
+        if (it != pending_.end()) {
+          if (it->second.stats) {
+            it->second.stats->fanout_us.Add(
+                absl::ToInt64Microseconds(now - it->second.sent));
+          }
+          if (--it->second.unseen == 0) pending_.erase(it);
+        }
+        const bool annotation = cmd.command_case() == Command::kDecl ||
+                                cmd.command_case() == Command::kMark;
+        if (annotation && awaiting_annotation_ != nullptr &&
+            sites_.count(ID(cmd.id()).site) == 0) {
+          awaiting_annotation_->annotate_us.Add(
+              absl::ToInt64Microseconds(now - annotation_since_));
+          awaiting_annotation_ = nullptr;
+        }
+      }
+    }
+  }
+
+  const boost::filesystem::path path_;
+  Client client_;
+  std::mt19937 rng_;
+  std::vector<std::unique_ptr<Replica>>* replicas_ = nullptr;
+  std::vector<std::thread> readers_;
+  std::map<std::string, std::unique_ptr<Stats>> stats_;
+  absl::Mutex mu_;
+  // our clients' sites: annotations from any other are the server's
+  std::set<int> sites_ GUARDED_BY(mu_);
+  std::map<uint64_t, Pending> pending_ GUARDED_BY(mu_);
+  Stats* awaiting_annotation_ GUARDED_BY(mu_) = nullptr;
+  absl::Time annotation_since_ GUARDED_BY(mu_);
+};
+
+REGISTER_APPLICATION(EditReplay);
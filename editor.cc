@@ -12,12 +12,21 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "editor.h"
+#include <gflags/gflags.h>
+#include <algorithm>
+#include <map>
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_split.h"
 
+DEFINE_int32(paste_chunk_bytes, 64 * 1024,
+             "Pastes are inserted (and sent) in pieces of this size, one "
+             "per round trip to the buffer");
+
 std::vector<std::string> Editor::DebugData() const {
   std::vector<std::string> r;
   r.push_back(absl::StrCat("cursor_line ", cursor_line_.value()));
+  r.push_back(absl::StrCat("first_column ", first_column_));
   r.push_back(absl::StrCat("nrow_before_sub ", debug_.nrow_before_sub));
   r.push_back(absl::StrCat("window_height ", debug_.window_height));
   r.push_back(absl::StrCat("cursor ", absl::Hex(cursor_.id, absl::kZeroPad16)));
@@ -34,103 +43,206 @@ std::vector<std::string> Editor::DebugData() const {
     }
   };
   add_proto("unpublished_commands", unpublished_commands_);
-  add_proto("unacknowledged_commands", unacknowledged_commands_);
+  for (const auto& unacked : unacknowledged_commands_) {
+    add_proto("unacknowledged_commands", unacked.commands);
+  }
   return r;
 }
 
+// a paste goes a chunk at a time, each once the last has been acknowledged:
+// the state we insert after then has it
+bool Editor::TakePasteChunk(PasteChunk* chunk) {
+  if (pending_pastes_.empty() || !unacknowledged_commands_.empty()) {
+    return false;
+  }
+  const auto& paste = pending_pastes_.front();
+  chunk->site = site_;
+  chunk->base = state_.content;
+  chunk->text = paste.text;
+  chunk->chars = absl::string_view(*paste.text).substr(paste.inserted,
+                                                       FLAGS_paste_chunk_bytes);
+  chunk->after = paste.after;
+  return true;
+}
+
+void Editor::PasteChunk::Insert() {
+  content = base;
+  last = content.Insert(&commands, site, chars, after);
+}
+
+// and take cursors at the end of the paste along to the end of the chunk
+void Editor::PutPasteChunk(PasteChunk* chunk) {
+  // updates (or key presses) that arrived meanwhile are more to integrate
+  // with the editor locked, but rarely: the chunk was due because the
+  // buffer had caught up with us
+  if (state_.content.SameTotalIdentity(chunk->base)) {
+    state_.content = chunk->content;
+  } else {
+    state_.content = state_.content.Integrate(chunk->commands);
+  }
+  pasted_commands_.MergeFrom(chunk->commands);
+  if (cursor_ == chunk->after) cursor_ = chunk->last;
+  for (auto& secondary : secondary_cursors_) {
+    if (secondary.cursor == chunk->after) secondary.cursor = chunk->last;
+  }
+  auto& paste = pending_pastes_.front();
+  paste.inserted += chunk->chars.size();
+  paste.after = chunk->last;
+  if (paste.inserted == paste.text->size()) pending_pastes_.pop_front();
+}
+
 EditResponse Editor::MakeResponse() {
+  PublishFind();
   PublishCursor();
 
   Log() << "EDITOR: " << name_ << " done:" << state_.shutdown;
 
   EditResponse r;
   r.done = state_.shutdown;
-  r.become_used = !unpublished_commands_.commands().empty();
   state_.content = state_.content.Integrate(unpublished_commands_);
-  r.content_updates.MergeFrom(unpublished_commands_);
-  unacknowledged_commands_.MergeFrom(unpublished_commands_);
-  unpublished_commands_.Clear();
+  if (!pasted_commands_.commands().empty()) {
+    pasted_commands_.MergeFrom(unpublished_commands_);
+    unpublished_commands_.Swap(&pasted_commands_);
+    pasted_commands_.Clear();
+  }
+  r.become_used = !unpublished_commands_.commands().empty();
+  if (unpublished_commands_.commands().empty()) return r;
+  UnacknowledgedCommands unacked;
+  // the batch is integrated all at once: one of its commands stands for it.
+  // It must be one nobody else could have made, creating an id of our site:
+  // a deletion is reflected as soon as another site makes it too
+  bool have_probe = false;
+  for (const auto& cmd : unpublished_commands_.commands()) {
+    if ((cmd.has_insert() || cmd.has_decl() || cmd.has_mark()) &&
+        site_->CreatedID(ID(cmd.id()))) {
+      unacked.probe = cmd;
+      have_probe = true;
+      break;
+    }
+  }
+  if (!have_probe) {
+    // the batch only deletes: it brings an attribute of its own along,
+    // deleted again as soon as it's declared
+    Attribute attr;
+    attr.mutable_tags();
+    const ID id =
+        AnnotatedString::MakeDecl(&unpublished_commands_, site_, attr);
+    unacked.probe = unpublished_commands_.commands(
+        unpublished_commands_.commands_size() - 1);
+    AnnotatedString::MakeDelDecl(&unpublished_commands_, id);
+  }
+  r.content_updates = unpublished_commands_;
+  unacked.commands.Swap(&unpublished_commands_);
+  unacknowledged_commands_.emplace_back(std::move(unacked));
   assert(unpublished_commands_.commands().empty());
   return r;
 }
 
 void Editor::PublishCursor() {
+  // every cursor's marks, in one batch: unmoved ones cost nothing
   AnnotationEditor::ScopedEdit edit(&ed_, &unpublished_commands_);
   Attribute curs;
   curs.mutable_cursor();
-  ed_.Mark(cursor_,
-           AnnotatedString::Iterator(state_.content, cursor_).Next().id(),
-           curs);
-  if (selection_anchor_ != ID()) {
-    Attribute sel;
-    sel.mutable_selection();
-    if (state_.content.OrderIDs(cursor_, selection_anchor_) < 0) {
-      ed_.Mark(cursor_, selection_anchor_, sel);
+  Attribute sel;
+  sel.mutable_selection();
+  auto mark = [&](ID cursor, ID selection_anchor) {
+    ed_.Mark(cursor,
+             AnnotatedString::Iterator(state_.content, cursor).Next().id(),
+             curs);
+    if (selection_anchor == ID()) return;
+    if (state_.content.OrderIDs(cursor, selection_anchor) < 0) {
+      ed_.Mark(cursor, selection_anchor, sel);
     } else {
-      ed_.Mark(selection_anchor_, cursor_, sel);
+      ed_.Mark(selection_anchor, cursor, sel);
     }
+  };
+  mark(cursor_, selection_anchor_);
+  for (const auto& secondary : secondary_cursors_) {
+    mark(secondary.cursor, secondary.selection_anchor);
   }
+  PublishBufferRefs(curs);
+  cursor_reported_ = cursor_;
+  secondary_cursors_reported_ = secondary_cursors_;
+}
+
+void Editor::PublishBufferRefs(const Attribute& curs) {
+  // the side buffer lines the cursor refers to
+  std::map<ID, std::vector<int>> referenced;
   AnnotatedString::Iterator(state_.content, cursor_)
-      .ForEachAttrValue([this, curs](const Attribute& attr) {
+      .ForEachAttrValue([&referenced](const Attribute& attr) {
         if (attr.data_case() != Attribute::kBufferRef) return;
-        auto it = buffers_.find(attr.buffer_ref().buffer());
-        if (it == buffers_.end()) return;
-        CommandSet cmds;
-        auto cur_content = it->second.buffer->ContentSnapshot();
-        {
-          AnnotationEditor::ScopedEdit edit_child(&it->second.ed, &cmds);
-          for (auto line : attr.buffer_ref().lines()) {
-            Log() << "Mark child frame line " << line;
-            AnnotatedString::LineIterator li =
-                AnnotatedString::LineIterator::FromLineNumber(cur_content,
-                                                              line);
-            it->second.ed.Mark(li.id(), li.Next().id(), curs);
-          }
-        }
-        Log() << "Push changes " << cmds.DebugString();
-        it->second.buffer->PushChanges(&cmds, true);
-        Log() << "Result: "
-              << it->second.buffer->ContentSnapshot().AsProto().DebugString();
+        auto& lines = referenced[attr.buffer_ref().buffer()];
+        lines.insert(lines.end(), attr.buffer_ref().lines().begin(),
+                     attr.buffer_ref().lines().end());
       });
-  cursor_reported_ = cursor_;
+  // only buffers whose marked lines change are edited (and pushed to)
+  for (auto& b : buffers_) {
+    std::vector<int> lines;
+    auto it = referenced.find(b.second.attr);
+    if (it != referenced.end()) {
+      lines.swap(it->second);
+      std::sort(lines.begin(), lines.end());
+      lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+    }
+    if (b.second.marked && *b.second.marked == lines) continue;
+    b.second.marked = lines;
+    const auto& starts =
+        b.second.lines.Starts(b.second.buffer->ContentSnapshot());
+    CommandSet cmds;
+    {
+      AnnotationEditor::ScopedEdit edit(&b.second.ed, &cmds);
+      for (int line : lines) {
+        if (line < 0 || line >= static_cast<int>(starts.size())) continue;
+        b.second.ed.Mark(starts[line],
+                         line + 1 < static_cast<int>(starts.size())
+                             ? starts[line + 1]
+                             : AnnotatedString::End(),
+                         curs);
+      }
+    }
+    b.second.buffer->PushChanges(&cmds, true);
+  }
 }
 
 void Editor::UpdateState(LogTimer* tmr, const EditNotification& state) {
   Log() << "EDITOR: " << name_ << " UpdateState shutdown=" << state.shutdown;
 
   state_ = state;
-  auto s2 = state_.content;
-  CommandSet unacked;
-  for (const auto& cmd : unacknowledged_commands_.commands()) {
-    auto s3 = s2;
-    s2.Integrate(cmd);
-    if (!s3.SameTotalIdentity(s2)) {
-      *unacked.add_commands() = cmd;
-      tmr->Mark("unacked");
-    } else {
-      tmr->Mark("acked");
-    }
-  }
-  unacknowledged_commands_.Swap(&unacked);
+  // checked batch by batch: other collaborators on this site (the find
+  // collaborator, say) may have commands integrated around ours
+  unacknowledged_commands_.erase(
+      std::remove_if(unacknowledged_commands_.begin(),
+                     unacknowledged_commands_.end(),
+                     [this](const UnacknowledgedCommands& unacked) {
+                       return state_.content.Reflects(unacked.probe);
+                     }),
+      unacknowledged_commands_.end());
+  tmr->Mark(unacknowledged_commands_.empty() ? "acked" : "unacked");
 
-  std::map<ID, BufferInfo> new_buffers;
+  std::map<std::string, BufferInfo> new_buffers;
   state_.content.ForEachAttribute(
       Attribute::kBuffer, [this, &new_buffers](ID id, const Attribute& attr) {
-        auto it = buffers_.find(id);
-        if (it != buffers_.end()) {
-          new_buffers.emplace(it->first, std::move(it->second));
-          buffers_.erase(it);
-        } else {
+        const auto& name = attr.buffer().name();
+        if (new_buffers.count(name)) return;
+        auto it = buffers_.find(name);
+        if (it == buffers_.end()) {
           AnnotatedString s;
           s.Insert(site_, attr.buffer().contents(), AnnotatedString::Begin());
-          new_buffers.emplace(id,
-                              BufferInfo{Buffer::Builder()
-                                             .SetFilename(attr.buffer().name())
-                                             .SetInitialString(s)
-                                             .SetSynthetic()
-                                             .Make(),
-                                         AnnotationEditor(site_)});
+          new_buffers.emplace(name, BufferInfo{Buffer::Builder()
+                                                   .SetFilename(name)
+                                                   .SetInitialString(s)
+                                                   .SetSynthetic()
+                                                   .Make(),
+                                               AnnotationEditor(site_), id,
+                                               attr.buffer().contents()});
+          return;
         }
+        auto& info =
+            new_buffers.emplace(name, std::move(it->second)).first->second;
+        buffers_.erase(it);
+        if (info.attr == id) return;
+        info.attr = id;
+        UpdateSideBuffer(&info, attr.buffer().contents());
       });
   buffers_.swap(new_buffers);
   for (auto& b : new_buffers) {
@@ -141,62 +253,341 @@ void Editor::UpdateState(LogTimer* tmr, const EditNotification& state) {
   }
 }
 
+namespace {
+
+// text's lines, each with its trailing newline (the last has none, and is
+// empty if text ends with one): one per LineIterator position
+std::vector<absl::string_view> SplitLines(absl::string_view text) {
+  std::vector<absl::string_view> lines;
+  for (;;) {
+    auto nl = text.find('\n');
+    if (nl == absl::string_view::npos) break;
+    lines.push_back(text.substr(0, nl + 1));
+    text.remove_prefix(nl + 1);
+  }
+  lines.push_back(text);
+  return lines;
+}
+
+}  // namespace
+
+// A recompile mostly leaves a side buffer's head and tail alone: replace
+// just the lines between, so the buffer (and its collaborators) outlive it.
+void Editor::UpdateSideBuffer(BufferInfo* info, const std::string& contents) {
+  const auto old_lines = SplitLines(info->contents);
+  const auto new_lines = SplitLines(contents);
+  size_t prefix = 0;
+  while (prefix < old_lines.size() && prefix < new_lines.size() &&
+         old_lines[prefix] == new_lines[prefix]) {
+    prefix++;
+  }
+  size_t suffix = 0;
+  while (suffix < old_lines.size() - prefix &&
+         suffix < new_lines.size() - prefix &&
+         old_lines[old_lines.size() - 1 - suffix] ==
+             new_lines[new_lines.size() - 1 - suffix]) {
+    suffix++;
+  }
+  if (prefix + suffix == old_lines.size() &&
+      prefix + suffix == new_lines.size()) {
+    info->contents = contents;
+    return;
+  }
+
+  const auto content = info->buffer->ContentSnapshot();
+  // the character the replaced lines follow
+  const ID after = info->lines.Starts(content)[prefix];
+  size_t removed = 0;
+  for (size_t i = prefix; i < old_lines.size() - suffix; i++) {
+    removed += old_lines[i].size();
+  }
+  std::string inserted;
+  for (size_t i = prefix; i < new_lines.size() - suffix; i++) {
+    absl::StrAppend(&inserted, new_lines[i]);
+  }
+  CommandSet cmds;
+  AnnotatedString::Iterator it(content, after);
+  for (size_t i = 0; i < removed; i++) {
+    it.MoveNext();
+    AnnotatedString::MakeDelete(&cmds, it.id());
+  }
+  if (!inserted.empty()) content.MakeInsert(&cmds, site_, inserted, after);
+  info->buffer->PushChanges(&cmds, true);
+  info->contents = contents;
+  info->marked.reset();
+}
+
+// Every cursor's edits go to unpublished_commands_, so a keystroke reaches
+// collaborators as one CommandSet however many cursors there are.
+template <class F>
+void Editor::ForEachCursor(F f) {
+  // only the primary cursor moves the view
+  const double cursor_line = cursor_line_.value();
+  for (auto& secondary : secondary_cursors_) {
+    std::swap(cursor_, secondary.cursor);
+    std::swap(selection_anchor_, secondary.selection_anchor);
+    f();
+    std::swap(cursor_, secondary.cursor);
+    std::swap(selection_anchor_, secondary.selection_anchor);
+  }
+  cursor_line_.set_value(cursor_line);
+  f();
+  MergeCursors();
+}
+
+// drop secondary cursors that have run into another cursor
+void Editor::MergeCursors() {
+  if (secondary_cursors_.empty()) return;
+  auto at = [this](ID id) {
+    return AnnotatedString::Iterator(state_.content, id).id();
+  };
+  std::set<ID> seen{at(cursor_)};
+  std::vector<SecondaryCursor> merged;
+  for (const auto& secondary : secondary_cursors_) {
+    if (seen.insert(at(secondary.cursor)).second) merged.push_back(secondary);
+  }
+  secondary_cursors_.swap(merged);
+}
+
+void Editor::AddCursorBelow() {
+  SecondaryCursor below{cursor_, ID()};
+  for (const auto& secondary : secondary_cursors_) {
+    if (state_.content.OrderIDs(secondary.cursor, below.cursor) > 0) {
+      below.cursor = secondary.cursor;
+    }
+  }
+  const ID primary = cursor_;
+  const double cursor_line = cursor_line_.value();
+  cursor_ = below.cursor;
+  CursorDownN(1);
+  below.cursor = cursor_;
+  cursor_ = primary;
+  cursor_line_.set_value(cursor_line);
+  secondary_cursors_.push_back(below);
+  MergeCursors();
+}
+
+// F(ID begin, ID end) -> bool: called for each occurrence of needle, as
+// [begin, end), from the first starting at or after from through the end of
+// the content and on from the start back round to from, until it returns
+// true
+template <class F>
+void Editor::ForEachOccurrence(const std::string& needle, ID from, F&& f) {
+  if (needle.empty()) return;
+  std::deque<std::pair<ID, char>> window;
+  AnnotatedString::Iterator it(state_.content, from);
+  if (it.is_begin()) it.MoveNext();
+  for (bool wrapped = false;; it.MoveNext()) {
+    if (it.is_end()) {
+      if (wrapped) return;
+      wrapped = true;
+      window.clear();
+      it = AnnotatedString::Iterator(state_.content, AnnotatedString::Begin());
+      continue;
+    }
+    if (wrapped && it.id() == from) return;
+    window.emplace_back(it.id(), it.value());
+    if (window.size() > needle.size()) window.pop_front();
+    if (window.size() < needle.size()) continue;
+    bool match = true;
+    for (size_t i = 0; match && i < needle.size(); i++) {
+      match = window[i].second == needle[i];
+    }
+    if (match && f(window.front().first, it.Next().id())) return;
+  }
+}
+
+void Editor::AddCursorAtNextOccurrence() {
+  if (!SelectMode()) return;
+  // selections span [lower, higher) of their two ends, as Copy sees them
+  const std::string needle = state_.content.Render(cursor_, selection_anchor_);
+  std::set<ID> taken{cursor_, selection_anchor_};
+  // search on from the furthest cursor, wrapping around to the start
+  ID from = cursor_;
+  auto further = [&](ID id) {
+    if (state_.content.OrderIDs(id, from) > 0) from = id;
+  };
+  further(selection_anchor_);
+  for (const auto& secondary : secondary_cursors_) {
+    taken.insert(secondary.cursor);
+    taken.insert(secondary.selection_anchor);
+    further(secondary.cursor);
+    further(secondary.selection_anchor);
+  }
+  ForEachOccurrence(needle, from, [&](ID begin, ID end) {
+    if (taken.count(begin) || taken.count(end)) {
+      // back round to the primary selection: every occurrence has a cursor
+      return begin == cursor_ || begin == selection_anchor_;
+    }
+    // orient it like the primary: is the cursor at the selection's end?
+    if (state_.content.OrderIDs(selection_anchor_, cursor_) < 0) {
+      secondary_cursors_.push_back(SecondaryCursor{end, begin});
+    } else {
+      secondary_cursors_.push_back(SecondaryCursor{begin, end});
+    }
+    return true;
+  });
+}
+
+// The find collaborator has marked the matches (those nearest the cursor
+// first), so rather than search the text, step to the next mark: only the
+// lines between here and there are walked, and only those with matches on
+// them character by character.
+void Editor::FindNext() {
+  if (find_ == ID()) return;
+  // by line start: where our query's matches begin
+  std::map<ID, std::set<ID>> matches;
+  state_.content.ForEachAnnotation(
+      Attribute::kFindMatch,
+      [&](ID, ID begin, ID, const Attribute& attr) {
+        if (ID(attr.find_match().find()) != find_) return;
+        matches[AnnotatedString::LineIterator(state_.content, begin).id()]
+            .insert(begin);
+      });
+  if (matches.empty()) return;
+  const ID from =
+      AnnotatedString::Iterator(state_.content, cursor_).Next().id();
+  AnnotatedString::LineIterator line(state_.content, from);
+  const ID from_line = line.id();
+  // from's line is looked at twice: after from, then (having wrapped round)
+  // before it
+  for (bool wrapped = false;;) {
+    const bool first = !wrapped && line.id() == from_line;
+    const bool last = wrapped && line.id() == from_line;
+    auto on_line = matches.find(line.id());
+    if (on_line != matches.end()) {
+      bool after_from = false;
+      AnnotatedString::Iterator it(state_.content, line.id());
+      for (it.MoveNext(); !it.is_end() && it.value() != '\n';
+           it.MoveNext()) {
+        if (it.id() == from) {
+          if (last) break;
+          after_from = true;
+        } else if ((!first || after_from) && on_line->second.count(it.id())) {
+          DropSecondaryCursors();
+          SetSelectMode(false);
+          cursor_ = it.Prev().id();
+          return;
+        }
+      }
+    }
+    if (last) return;
+    if (!line.MoveNext() || line.is_end()) {
+      if (wrapped) return;
+      wrapped = true;
+      line = AnnotatedString::LineIterator(state_.content,
+                                           AnnotatedString::Begin());
+    }
+  }
+}
+
+// the query goes into the content for the find collaborator to search for,
+// and to tell the matches it marks for us apart from other editors'
+void Editor::PublishFind() {
+  const std::string& query = finding_ ? find_editor_.text() : std::string();
+  if (query == find_published_) return;
+  if (find_ != ID()) {
+    AnnotatedString::MakeDelDecl(&unpublished_commands_, find_);
+    find_ = ID();
+  }
+  if (!query.empty()) {
+    Attribute find;
+    find.mutable_find()->set_query(query);
+    find_ = AnnotatedString::MakeDecl(&unpublished_commands_, site_, find);
+  }
+  find_published_ = query;
+}
+
+void Editor::DropSecondaryCursors() { secondary_cursors_.clear(); }
+
 void Editor::SelectLeft() {
-  SetSelectMode(true);
-  CursorLeft();
+  ForEachCursor([this]() {
+    SetSelectMode(true);
+    CursorLeft();
+  });
 }
 
 void Editor::MoveLeft() {
-  SetSelectMode(false);
-  CursorLeft();
+  ForEachCursor([this]() {
+    SetSelectMode(false);
+    CursorLeft();
+  });
 }
 
 void Editor::SelectRight() {
-  SetSelectMode(true);
-  CursorRight();
+  ForEachCursor([this]() {
+    SetSelectMode(true);
+    CursorRight();
+  });
 }
 
 void Editor::MoveRight() {
-  SetSelectMode(false);
-  CursorRight();
+  ForEachCursor([this]() {
+    SetSelectMode(false);
+    CursorRight();
+  });
 }
 
 void Editor::MoveStartOfLine() {
-  SetSelectMode(false);
-  CursorStartOfLine();
+  ForEachCursor([this]() {
+    SetSelectMode(false);
+    CursorStartOfLine();
+  });
 }
 
 void Editor::MoveEndOfLine() {
-  SetSelectMode(false);
-  CursorEndOfLine();
+  ForEachCursor([this]() {
+    SetSelectMode(false);
+    CursorEndOfLine();
+  });
 }
 
 void Editor::MoveDownN(int n) {
-  SetSelectMode(false);
-  for (int i = 0; i < n; i++) CursorDown();
+  ForEachCursor([this, n]() {
+    SetSelectMode(false);
+    CursorDownN(n);
+  });
 }
 
 void Editor::MoveUpN(int n) {
-  SetSelectMode(false);
-  for (int i = 0; i < n; i++) CursorUp();
+  ForEachCursor([this, n]() {
+    SetSelectMode(false);
+    CursorUpN(n);
+  });
 }
 
 void Editor::SelectDownN(int n) {
-  SetSelectMode(true);
-  for (int i = 0; i < n; i++) CursorDown();
+  ForEachCursor([this, n]() {
+    SetSelectMode(true);
+    CursorDownN(n);
+  });
 }
 
 void Editor::SelectUpN(int n) {
-  SetSelectMode(true);
-  for (int i = 0; i < n; i++) CursorUp();
+  ForEachCursor([this, n]() {
+    SetSelectMode(true);
+    CursorUpN(n);
+  });
 }
 
-void Editor::Backspace() {
+void Editor::GoToLine(int line) {
+  DropSecondaryCursors();
   SetSelectMode(false);
-  state_.content.MakeDelete(&unpublished_commands_, cursor_);
-  AnnotatedString::Iterator it(state_.content, cursor_);
-  it.MovePrev();
-  cursor_ = it.id();
+  const auto& starts = LineStarts();
+  line = std::max(0, std::min<int>(line, starts.size() - 1));
+  const int col = CursorColumn();
+  CursorToColumn(AnnotatedString::LineIterator(state_.content, starts[line]),
+                 col);
+}
+
+void Editor::Backspace() {
+  ForEachCursor([this]() {
+    SetSelectMode(false);
+    // integrated as it's made, like an insert, so the next cursor sees it:
+    // the iterator steps back from the deleted character by itself
+    state_.content.Delete(&unpublished_commands_, cursor_);
+    cursor_ = AnnotatedString::Iterator(state_.content, cursor_).id();
+  });
 }
 
 void Editor::Copy(Renderer* d) {
@@ -208,26 +599,38 @@ void Editor::Copy(Renderer* d) {
 void Editor::Cut(Renderer* d) {
   if (SelectMode()) {
     d->ClipboardPut(state_.content.Render(cursor_, selection_anchor_));
-    DeleteSelection();
-    SetSelectMode(false);
   }
+  ForEachCursor([this]() {
+    if (SelectMode()) {
+      DeleteSelection();
+      SetSelectMode(false);
+    }
+  });
 }
 
 void Editor::Paste(Renderer* d) {
-  if (selection_anchor_ != ID()) {
-    DeleteSelection();
-    SetSelectMode(false);
-  }
-  cursor_ = state_.content.Insert(&unpublished_commands_, site_,
-                                  d->ClipboardGet(), cursor_);
+  auto text = std::make_shared<const std::string>(d->ClipboardGet());
+  ForEachCursor([this, &text]() {
+    if (selection_anchor_ != ID()) {
+      DeleteSelection();
+      SetSelectMode(false);
+    }
+    // inserted by the collaborator thread, not this one: see
+    // TakePasteChunk
+    if (!text->empty()) {
+      pending_pastes_.push_back(PendingPaste{text, 0, cursor_});
+    }
+  });
 }
 
 void Editor::InsChar(char c) {
-  DeleteSelection();
-  SetSelectMode(false);
-  cursor_ = state_.content.Insert(&unpublished_commands_, site_,
-                                  absl::string_view(&c, 1), cursor_);
-  ChangeCursorLine(c == '\n');
+  ForEachCursor([this, c]() {
+    DeleteSelection();
+    SetSelectMode(false);
+    cursor_ = state_.content.Insert(&unpublished_commands_, site_,
+                                    absl::string_view(&c, 1), cursor_);
+    ChangeCursorLine(c == '\n');
+  });
 }
 
 void Editor::SetSelectMode(bool sel) {
@@ -240,10 +643,8 @@ void Editor::SetSelectMode(bool sel) {
 
 void Editor::DeleteSelection() {
   if (!SelectMode()) return;
-  state_.content.MakeDelete(&unpublished_commands_, cursor_, selection_anchor_);
-  AnnotatedString::Iterator it(state_.content, cursor_);
-  it.MovePrev();
-  cursor_ = it.id();
+  state_.content.Delete(&unpublished_commands_, cursor_, selection_anchor_);
+  cursor_ = AnnotatedString::Iterator(state_.content, cursor_).id();
 }
 
 void Editor::CursorLeft() {
@@ -260,51 +661,68 @@ void Editor::CursorRight() {
   cursor_ = it.id();
 }
 
-void Editor::CursorDown() {
-  AnnotatedString::Iterator it(state_.content, cursor_);
-  int col = 0;
-  auto edge = [&it]() {
-    return it.is_begin() || it.is_end() || it.value() == '\n';
-  };
-  while (!edge()) {
-    it.MovePrev();
-    col++;
+// moving between lines follows the content's line breaks, so costs the
+// lines moved and the column, not the size of the file
+
+void Editor::CursorDownN(int n) {
+  const int col = CursorColumn();
+  AnnotatedString::LineIterator line(state_.content, cursor_);
+  int moved = 0;
+  for (; moved < n && !line.Next().is_end(); moved++) {
+    line.MoveNext();
   }
-  Log() << "col:" << col;
-  it = AnnotatedString::Iterator(state_.content, cursor_);
-  do {
-    it.MoveNext();
-  } while (!edge());
-  it.MoveNext();
-  for (; col > 0 && !edge(); col--) {
-    it.MoveNext();
+  CursorToColumn(line, col);
+  ChangeCursorLine(moved);
+}
+
+void Editor::CursorUpN(int n) {
+  const int col = CursorColumn();
+  AnnotatedString::LineIterator line(state_.content, cursor_);
+  int moved = 0;
+  for (; moved < n && line.MovePrev(); moved++) {
   }
-  it.MovePrev();
-  cursor_ = it.id();
-  ChangeCursorLine(1);
+  CursorToColumn(line, col);
+  ChangeCursorLine(-moved);
 }
 
-void Editor::CursorUp() {
+int Editor::CursorColumn() const {
+  const ID start = AnnotatedString::LineIterator(state_.content, cursor_).id();
   AnnotatedString::Iterator it(state_.content, cursor_);
   int col = 0;
-  auto edge = [&it]() {
-    return it.is_begin() || it.is_end() || it.value() == '\n';
-  };
-  while (!edge()) {
+  for (; it.id() != start; col++) {
     it.MovePrev();
-    col++;
   }
-  Log() << "col:" << col;
-  do {
-    it.MovePrev();
-  } while (!edge());
-  it.MoveNext();
-  for (; col > 0 && !edge(); col--) {
+  return col;
+}
+
+// place the cursor col characters into line, or at its end if it's shorter
+void Editor::CursorToColumn(AnnotatedString::LineIterator line, int col) {
+  AnnotatedString::Iterator it = line.AsIterator();
+  for (; col > 0; col--) {
     it.MoveNext();
+    if (it.is_end() || it.value() == '\n') {
+      it.MovePrev();
+      break;
+    }
   }
-  it.MovePrev();
   cursor_ = it.id();
-  ChangeCursorLine(-1);
+}
+
+const std::vector<ID>& Editor::LineIndex::Starts(
+    const AnnotatedString& content) {
+  if (starts_.empty() || !content_.SameLineIdentity(content)) {
+    content_ = content;
+    starts_.clear();
+    AnnotatedString::LineIterator line(content, AnnotatedString::Begin());
+    do {
+      starts_.push_back(line.id());
+    } while (line.MoveNext() && !line.is_end());
+  }
+  return starts_;
+}
+
+const std::vector<ID>& Editor::LineStarts() {
+  return line_index_.Starts(state_.content);
 }
 
 void Editor::CursorStartOfLine() {
@@ -319,11 +737,46 @@ void Editor::CursorEndOfLine() {
                 .id();
 }
 
-void Editor::Render(Theme* theme, Widget* parent) {
-  Widget* content = parent->MakeContent(
-      Widget::Options().set_id(name_).set_activatable(editable_));
+Widget* Editor::MakeContent(const std::string& name, bool editable,
+                            Widget* parent) {
+  return parent->MakeContent(
+      Widget::Options().set_id(name).set_activatable(editable));
+}
+
+std::shared_ptr<const Editor::Frame> Editor::Render(Theme* theme,
+                                                    Widget* parent) {
+  Widget* content = MakeContent(name_, editable_, parent);
 
-  if (content->Focus()) {
+  if (content->Focus() && going_to_line_) {
+    if (auto c = content->CharPressed()) {
+      if (c >= '0' && c <= '9') line_number_editor_.InsChar(c);
+    } else if (content->Chord("del")) {
+      line_number_editor_.Backspace();
+    } else if (content->Chord("ret")) {
+      int line;
+      // numbered from one, as the user sees them
+      if (absl::SimpleAtoi(line_number_editor_.text(), &line)) {
+        GoToLine(line - 1);
+      }
+      going_to_line_ = false;
+    } else if (content->Chord("C-g")) {
+      going_to_line_ = false;
+    }
+  } else if (content->Focus() && finding_) {
+    if (auto c = content->CharPressed()) {
+      find_editor_.InsChar(c);
+    } else if (content->Chord("del")) {
+      find_editor_.Backspace();
+    } else if (content->Chord("left")) {
+      find_editor_.MoveLeft();
+    } else if (content->Chord("right")) {
+      find_editor_.MoveRight();
+    } else if (content->Chord("ret")) {
+      FindNext();
+    } else if (content->Chord("C-f")) {
+      finding_ = false;
+    }
+  } else if (content->Focus()) {
     if (auto c = content->CharPressed()) {
       InsChar(c);
     } else if (content->Chord("up")) {
@@ -338,10 +791,26 @@ void Editor::Render(Theme* theme, Widget* parent) {
       MoveStartOfLine();
     } else if (content->Chord("end")) {
       MoveEndOfLine();
+    } else if (content->Chord("page-up")) {
+      MovePageUp();
+    } else if (content->Chord("page-down")) {
+      MovePageDown();
     } else if (content->Chord("S-up")) {
       SelectUp();
     } else if (content->Chord("S-down")) {
       SelectDown();
+    } else if (content->Chord("C-f")) {
+      finding_ = true;
+      find_editor_.Clear();
+    } else if (content->Chord("C-g")) {
+      going_to_line_ = true;
+      line_number_editor_.Clear();
+    } else if (content->Chord("C-d")) {
+      AddCursorAtNextOccurrence();
+    } else if (content->Chord("C-n")) {
+      AddCursorBelow();
+    } else if (content->Chord("C-u")) {
+      DropSecondaryCursors();
     } else if (content->Chord("del")) {
       Backspace();
     } else if (content->Chord("C-c")) {
@@ -355,54 +824,125 @@ void Editor::Render(Theme* theme, Widget* parent) {
     }
   }
 
+  auto ex = parent->renderer()->extents();
+  page_rows_ = std::max(
+      1, static_cast<int>((parent->bottom().value() - parent->top().value()) /
+                          ex.chr_height) -
+             1);
+  if (editable_) {
+    ScrollToCursorColumn(std::max(
+        1, static_cast<int>((content->right().value() -
+                             content->left().value()) /
+                            ex.chr_width)));
+  }
+  cursor_ = AnnotatedString::Iterator(state_.content, cursor_).id();
+  {
+    auto secondary_carets = std::make_shared<std::set<ID>>();
+    if (editable_) {
+      for (auto& secondary : secondary_cursors_) {
+        secondary.cursor =
+            AnnotatedString::Iterator(state_.content, secondary.cursor).id();
+        secondary_carets->insert(secondary.cursor);
+      }
+    }
+    if (*secondary_carets != *secondary_carets_) {
+      secondary_carets_ = secondary_carets;
+    }
+  }
+  auto frame = std::make_shared<Frame>();
+  frame->name = name_;
+  frame->editable = editable_;
+  frame->focused = content->Focus();
+  if (going_to_line_) {
+    frame->status = absl::StrCat("go to line: ", line_number_editor_.text());
+  } else if (finding_) {
+    frame->status = absl::StrCat("find: ", find_editor_.text());
+  }
+  frame->content = state_.content;
+  frame->cursor = editable_ ? cursor_ : ID();
+  frame->line_start =
+      AnnotatedString::LineIterator(state_.content, cursor_).id();
+  frame->secondary_carets = secondary_carets_;
+  frame->find = find_;
+  frame->first_column = first_column_;
+  frame->cursor_line = cursor_line_.value();
+  frame->line_renders = line_renders_;
+  Layout(*frame, cursor_line_, theme, parent, content);
+  return frame;
+}
+
+void Editor::RenderFrame(const Frame& frame, Theme* theme, Widget* parent) {
+  // a variable of its own: the editor's may be in use on another thread
+  Layout(frame, rhea::variable(frame.cursor_line), theme, parent,
+         MakeContent(frame.name, frame.editable, parent));
+}
+
+void Editor::Layout(const Frame& frame, rhea::variable cursor_line,
+                    Theme* theme, Widget* parent, Widget* content) {
+  if (!frame.status.empty()) {
+    parent->MakeSimpleText(theme->ThemeToken({}, 0), {frame.status});
+  }
   auto* r = parent->renderer();
   auto ex = r->extents();
   r->solver()->add_constraints(
-      {rhea::constraint(cursor_line_ == cursor_line_.value(),
+      {rhea::constraint(cursor_line == cursor_line.value(),
                         rhea::strength::strong()),
        rhea::constraint(
            content->right() - content->left() >= 80 * ex.chr_width,
-           editable_ ? rhea::strength::strong() : rhea::strength::weak()),
+           frame.editable ? rhea::strength::strong() : rhea::strength::weak()),
        rhea::constraint(content->bottom() - content->top() >= 3 * ex.chr_height,
                         rhea::strength::weak()),
-       cursor_line_ * ex.chr_height >= 0,
-       cursor_line_ * ex.chr_height <=
+       cursor_line * ex.chr_height >= 0,
+       cursor_line * ex.chr_height <=
            parent->bottom() - parent->top() - ex.chr_height});
 
-  ID cursor = cursor_ = AnnotatedString::Iterator(state_.content, cursor_).id();
-  AnnotatedString::LineIterator line_cr(state_.content, cursor_);
-  rhea::variable cursor_line = cursor_line_;
-  if (!editable_) cursor = ID();
-  content->Draw(
-      [line_cr, cursor_line, cursor, ex, theme, content](DeviceContext* ctx) {
-        ctx->Fill(0, 0, ctx->width(), ctx->height(),
-                  theme->ThemeToken({}, 0).background);
-        float cl = cursor_line.value() * ex.chr_height;
-        ctx->Fill(0, cl, ctx->width(), cl + ex.chr_height,
-                  theme->ThemeToken({}, Theme::HIGHLIGHT_LINE).background);
-        AnnotatedString::LineIterator line_bk = line_cr;
-        AnnotatedString::LineIterator line_fw = line_cr;
-        RenderLine(ctx, ex, theme, cursor, cl, line_cr, true);
-        for (int i = 1; i <= ctx->height() / ex.chr_height; i++) {
-          if (line_bk.MovePrev()) {
-            RenderLine(ctx, ex, theme, cursor, cl - i * ex.chr_height, line_bk,
-                       false);
-          }
-          if (line_fw.MoveNext()) {
-            RenderLine(ctx, ex, theme, cursor, cl + i * ex.chr_height, line_fw,
-                       false);
-          }
-        }
-      });
+  const AnnotatedString str = frame.content;
+  const ID line_start = frame.line_start;
+  const ID cursor = frame.cursor;
+  const CaretSet secondary_carets = frame.secondary_carets;
+  const ID find = frame.find;
+  const int first_column = frame.first_column;
+  auto line_renders = frame.line_renders;
+  content->Draw([str, line_start, cursor_line, cursor, secondary_carets, find,
+                 first_column, line_renders, ex, theme,
+                 content](DeviceContext* ctx) {
+    ctx->Fill(0, 0, ctx->width(), ctx->height(),
+              theme->ThemeToken({}, 0).background);
+    float cl = cursor_line.value() * ex.chr_height;
+    ctx->Fill(0, cl, ctx->width(), cl + ex.chr_height,
+              theme->ThemeToken({}, Theme::HIGHLIGHT_LINE).background);
+    LineRenderCache this_frame;
+    auto render_line = [&](float y, AnnotatedString::LineIterator lit,
+                           bool highlight) {
+      RenderLine(ctx, ex, theme, cursor, secondary_carets, find, y,
+                 first_column, lit, highlight, str, line_renders.get(),
+                 &this_frame);
+    };
+    AnnotatedString::LineIterator line_cr(str, line_start);
+    AnnotatedString::LineIterator line_bk = line_cr;
+    AnnotatedString::LineIterator line_fw = line_cr;
+    render_line(cl, line_cr, true);
+    for (int i = 1; i <= ctx->height() / ex.chr_height; i++) {
+      if (line_bk.MovePrev()) {
+        render_line(cl - i * ex.chr_height, line_bk, false);
+      }
+      if (line_fw.MoveNext()) {
+        render_line(cl + i * ex.chr_height, line_fw, false);
+      }
+    }
+    line_renders->swap(this_frame);
+  });
 }
 
 typedef absl::InlinedVector<std::string, 2> GutterVec;
 
 struct CharDet {
-  CharDet(uint32_t base_flags, GutterVec* g)
-      : chr_flags(base_flags), gutters(g) {}
+  CharDet(uint32_t base_flags, ID f, GutterVec* g)
+      : chr_flags(base_flags), find(f), gutters(g) {}
   bool has_diagnostic = false;
   uint32_t chr_flags;
+  // only matches for this Find are highlighted
+  const ID find;
   std::vector<std::string> tags;
   GutterVec* const gutters;
 
@@ -422,6 +962,11 @@ struct CharDet {
         case Attribute::kDiagnostic:
           has_diagnostic = true;
           break;
+        case Attribute::kFindMatch:
+          if (ID(attr.find_match().find()) == find) {
+            chr_flags |= Theme::FIND_MATCH;
+          }
+          break;
         case Attribute::kTags:
           for (auto t : attr.tags().tags()) {
             tags.push_back(t);
@@ -456,53 +1001,170 @@ struct CharDet {
   }
 };
 
+void Editor::ScrollToCursorColumn(int columns) {
+  const int col = CursorColumn();
+  if (col < first_column_) {
+    first_column_ = col;
+  } else if (col >= first_column_ + columns) {
+    first_column_ = col - columns + 1;
+  }
+}
+
 void Editor::RenderLine(DeviceContext* ctx, const Device::Extents& extents,
-                        Theme* theme, ID cursor, int y,
-                        AnnotatedString::LineIterator lit, bool highlight) {
+                        Theme* theme, ID cursor,
+                        const CaretSet& secondary_carets, ID find, int y,
+                        int first_column, AnnotatedString::LineIterator lit,
+                        bool highlight,
+                        const AnnotatedString& content,
+                        LineRenderCache* last_frame,
+                        LineRenderCache* this_frame) {
+  const size_t columns = ctx->width() / extents.chr_width + 1;
+  const LineRender* render = nullptr;
+  auto last = last_frame->find(lit.id());
+  if (last != last_frame->end() && last->second.theme == theme &&
+      last->second.find == find &&
+      last->second.first_column == first_column &&
+      last->second.columns == columns && last->second.highlight == highlight &&
+      CanReuse(last->second, content, lit.id()) &&
+      SameCarets(last->second, cursor, secondary_carets)) {
+    // as of this content, so the next frame can tell it's unchanged at once
+    last->second.content = content;
+    last->second.cursor = cursor;
+    last->second.secondary_carets = secondary_carets;
+    render =
+        &this_frame->emplace(lit.id(), std::move(last->second)).first->second;
+  } else {
+    render = &this_frame
+                  ->emplace(lit.id(),
+                            LayoutLine(extents, theme, cursor,
+                                       secondary_carets, find, first_column,
+                                       columns, lit, highlight, content))
+                  .first->second;
+  }
+
+  for (const auto& fill : render->fills) {
+    ctx->Fill(fill.first * extents.chr_width, y,
+              (fill.first + 1) * extents.chr_width, y + extents.chr_height,
+              fill.second);
+  }
+  for (const auto& caret : render->carets) {
+    ctx->PutCaret(caret.x, y + caret.y, caret.flags, caret.color);
+  }
+  ctx->PutText(0, y, render->text.data(), render->text.size());
+  int x = ctx->width() - render->gutter.length() * extents.chr_width;
+  ctx->Fill(x, y, ctx->width(), y + extents.chr_height,
+            render->gutter_fmt.background);
+  ctx->PutText(x, y, render->gutter.data(), render->gutter.length(),
+               render->gutter_fmt.foreground, render->gutter_fmt.highlight);
+}
+
+// A character's look depends only on its id, its visibility and the
+// annotations on it (annotation and attribute ids are never reused for
+// other values), so a line drawn from another version of the content can be
+// redrawn as long as those match up to the last character it looked at.
+bool Editor::CanReuse(const LineRender& render, const AnnotatedString& content,
+                      ID line) {
+  if (render.content.SameTotalIdentity(content)) return true;
+  AnnotatedString::AllIterator was(render.content, line);
+  AnnotatedString::AllIterator is(content, line);
+  for (;;) {
+    if (!was.SameCharacter(is)) return false;
+    if (was.id() == render.last) return true;
+    was.MoveNext();
+    is.MoveNext();
+  }
+}
+
+// Checked after CanReuse, so the line's characters are the ones its carets
+// were placed among.
+bool Editor::SameCarets(const LineRender& render, ID cursor,
+                        const CaretSet& secondary_carets) {
+  if (render.cursor == cursor &&
+      render.secondary_carets == secondary_carets) {
+    return true;
+  }
+  for (ID id : render.caret_spots) {
+    if (CaretFlags(id, render.cursor, render.secondary_carets) !=
+        CaretFlags(id, cursor, secondary_carets)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+unsigned Editor::CaretFlags(ID id, ID cursor,
+                            const CaretSet& secondary_carets) {
+  if (id == cursor) return CARET_PRIMARY | CARET_BLINKING;
+  if (secondary_carets->count(id)) return CARET_BLINKING;
+  return 0;
+}
+
+Editor::LineRender Editor::LayoutLine(const Device::Extents& extents,
+                                      Theme* theme, ID cursor,
+                                      const CaretSet& secondary_carets,
+                                      ID find, int first_column,
+                                      size_t columns,
+                                      AnnotatedString::LineIterator lit,
+                                      bool highlight,
+                                      const AnnotatedString& content) {
+  LineRender render{content, theme,        cursor,  secondary_carets,
+                    find,    first_column, columns, highlight,
+                    lit.id()};
+  auto put_caret = [&](ID id, float x, float y,
+                       const std::vector<std::string>& tags) {
+    render.caret_spots.push_back(id);
+    const unsigned flags = CaretFlags(id, cursor, secondary_carets);
+    if (!flags) return;
+    render.carets.push_back(LineRender::Caret{
+        x, y, flags, theme->ThemeToken(tags, Theme::CARET).foreground});
+  };
   AnnotatedString::AllIterator it = lit.AsAllIterator();
+  // skip the columns scrolled off to the left without looking at their
+  // attributes; a line that ends before the view leaves it on its newline
+  // (or the end), which stops the loop below
+  for (int skipped = 0; skipped < first_column;) {
+    it.MoveNext();
+    if (it.is_end()) break;
+    if (!it.is_visible()) continue;
+    if (it.value() == '\n') break;
+    if (++skipped < first_column) continue;
+    put_caret(it.id(), 0, 0, {});
+    it.MoveNext();
+  }
   const uint32_t base_flags = highlight ? Theme::HIGHLIGHT_LINE : 0;
   GutterVec gutter_annotations;
-  std::vector<DeviceContext::TextElem> to_print;
+  auto& to_print = render.text;
   CharFmt base_fmt = theme->ThemeToken({}, 0);
   while (it.id() != AnnotatedString::End()) {
+    render.last = it.id();
     if (it.is_visible() || it.is_begin()) {
-      CharDet cd(base_flags, &gutter_annotations);
+      CharDet cd(base_flags, find, &gutter_annotations);
       cd.FillFromIterator(it);
       if (cd.has_diagnostic) {
         cd.tags.push_back("invalid");
       }
       if (it.is_visible() && it.id() != lit.id()) {
         if (it.value() == '\n') {
-          if (it.id() == cursor) {
-            ctx->PutCaret(0, y + extents.chr_height,
-                          CARET_PRIMARY | CARET_BLINKING,
-                          theme->ThemeToken(cd.tags, Theme::CARET).foreground);
-          }
+          put_caret(it.id(), 0, extents.chr_height, cd.tags);
           break;
         } else {
+          if (to_print.size() == columns) break;
           char c = it.value();
           auto fmt = theme->ThemeToken(cd.tags, cd.chr_flags);
           if (fmt.background != base_fmt.background) {
-            ctx->Fill(to_print.size() * extents.chr_width, y, (to_print.size()+1) * extents.chr_width, y + extents.chr_height, fmt.background);
+            render.fills.emplace_back(to_print.size(), fmt.background);
           }
           to_print.emplace_back(DeviceContext::TextElem{
               static_cast<uint32_t>(c), fmt.foreground, fmt.highlight});
         }
       }
-      if (it.id() == cursor) {
-        ctx->PutCaret(to_print.size() * extents.chr_width, y,
-                      CARET_PRIMARY | CARET_BLINKING,
-                      theme->ThemeToken(cd.tags, Theme::CARET).foreground);
-      }
+      put_caret(it.id(), to_print.size() * extents.chr_width, 0, cd.tags);
     }
     it.MoveNext();
   }
-  ctx->PutText(0, y, to_print.data(), to_print.size());
-  std::string gutter = absl::StrJoin(gutter_annotations, ",");
-  int x = ctx->width() - gutter.length() * extents.chr_width;
-  CharFmt fill_attr =
+  if (it.id() == AnnotatedString::End()) render.last = it.id();
+  render.gutter = absl::StrJoin(gutter_annotations, ",");
+  render.gutter_fmt =
       theme->ThemeToken(::Theme::Tag{"comment.gutter"}, base_flags);
-  ctx->Fill(x, y, ctx->width(), y + extents.chr_height, fill_attr.background);
-  ctx->PutText(x, y, gutter.data(), gutter.length(), fill_attr.foreground,
-               fill_attr.highlight);
+  return render;
 }
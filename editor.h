@@ -13,10 +13,15 @@
 // limitations under the License.
 #pragma once
 
+#include <deque>
+#include <memory>
 #include <numeric>
+#include <set>
 #include <string>
+#include <vector>
 #include "absl/strings/str_join.h"
 #include "buffer.h"
+#include "line_editor.h"
 #include "log.h"
 #include "render.h"
 #include "theme.h"
@@ -38,10 +43,35 @@ class Editor : public std::enable_shared_from_this<Editor> {
   const EditNotification& CurrentState() { return state_; }
   bool HasCommands() {
     return state_.shutdown || !unpublished_commands_.commands().empty() ||
-           cursor_reported_ != cursor_;
+           cursor_reported_ != cursor_ ||
+           secondary_cursors_reported_ != secondary_cursors_ ||
+           (finding_ ? find_editor_.text() : std::string()) !=
+               find_published_ ||
+           (!pending_pastes_.empty() && unacknowledged_commands_.empty());
   }
   EditResponse MakeResponse();
 
+  // the next chunk of a large paste, inserted with the editor unlocked: see
+  // ClientCollaborator::Pull. TakePasteChunk says what to insert where (if
+  // a chunk is due), Insert does so on the copy of the content taken with
+  // it, and PutPasteChunk brings the result back to the editor
+  struct PasteChunk {
+    void Insert();
+
+    Site* site;
+    AnnotatedString base;
+    // chars is a piece of text
+    std::shared_ptr<const std::string> text;
+    absl::string_view chars;
+    ID after;
+    // base with chars inserted, by commands
+    AnnotatedString content;
+    CommandSet commands;
+    ID last;
+  };
+  bool TakePasteChunk(PasteChunk* chunk);
+  void PutPasteChunk(PasteChunk* chunk);
+
   std::vector<std::string> DebugData() const;
 
   // editor commands
@@ -59,6 +89,17 @@ class Editor : public std::enable_shared_from_this<Editor> {
   void SelectUpN(int n);
   void SelectDown() { SelectDownN(1); }
   void SelectUp() { SelectUpN(1); }
+  void MovePageDown() { MoveDownN(page_rows_); }
+  void MovePageUp() { MoveUpN(page_rows_); }
+  // line numbers count from zero
+  void GoToLine(int line);
+  // secondary cursors: each edits alongside the primary one
+  void AddCursorBelow();
+  void AddCursorAtNextOccurrence();
+  void DropSecondaryCursors();
+  // find: C-f starts typing a query, highlighted where it matches (see
+  // find_collaborator.cc), and ret moves to the next match
+  void FindNext();
   void Backspace();
   void Copy(Renderer* env);
   void Cut(Renderer* env);
@@ -66,16 +107,40 @@ class Editor : public std::enable_shared_from_this<Editor> {
   void InsNewLine() { InsChar('\n'); }
   void InsChar(char c);
 
-  void Render(Theme* theme, Widget* parent);
+  // everything a frame of this editor is drawn from: Render returns the one
+  // it drew, and RenderFrame draws it again without touching the editor
+  struct Frame;
+  std::shared_ptr<const Frame> Render(Theme* theme, Widget* parent);
+  static void RenderFrame(const Frame& frame, Theme* theme, Widget* parent);
 
  private:
   void CursorLeft();
   void CursorRight();
-  void CursorDown();
-  void CursorUp();
+  void CursorDownN(int n);
+  void CursorUpN(int n);
+  int CursorColumn() const;
+  void CursorToColumn(AnnotatedString::LineIterator line, int col);
+  const std::vector<ID>& LineStarts();
   void CursorStartOfLine();
   void CursorEndOfLine();
   void PublishCursor();
+  void PublishBufferRefs(const Attribute& curs);
+  struct BufferInfo;
+  void UpdateSideBuffer(BufferInfo* info, const std::string& contents);
+
+  template <class F>
+  void ForEachCursor(F f);
+  template <class F>
+  void ForEachOccurrence(const std::string& needle, ID from, F&& f);
+  void PublishFind();
+  void MergeCursors();
+
+  struct PendingPaste {
+    std::shared_ptr<const std::string> text;
+    size_t inserted;
+    // the last character inserted so far
+    ID after;
+  };
 
   void SetSelectMode(bool sel);
   bool SelectMode() const { return selection_anchor_ != ID(); }
@@ -86,10 +151,89 @@ class Editor : public std::enable_shared_from_this<Editor> {
       cursor_line_.set_value(cursor_line_.value() + delta);
     }
   }
+  void ScrollToCursorColumn(int columns);
+
+  // where secondary cursors' carets go; shared between frames while they
+  // don't move
+  typedef std::shared_ptr<const std::set<ID>> CaretSet;
+  // what RenderLine draws for one line, kept across frames while nothing
+  // it was drawn from changes
+  struct LineRender {
+    // drawn from
+    AnnotatedString content;
+    Theme* theme;
+    ID cursor;
+    CaretSet secondary_carets;
+    ID find;
+    int first_column;
+    size_t columns;
+    bool highlight;
+    // the last character looked at
+    ID last;
+    // the characters a caret would have been drawn at: moving the cursor
+    // and carets between other characters doesn't change the line
+    std::vector<ID> caret_spots;
+    // the drawing, relative to the line's top left
+    std::vector<DeviceContext::TextElem> text;
+    // column, background
+    std::vector<std::pair<size_t, Color>> fills;
+    struct Caret {
+      float x;
+      float y;
+      unsigned flags;
+      Color color;
+    };
+    std::vector<Caret> carets;
+    std::string gutter;
+    CharFmt gutter_fmt;
+  };
+  // by line start id: the lines drawn in the last frame
+  typedef std::map<ID, LineRender> LineRenderCache;
+  static Widget* MakeContent(const std::string& name, bool editable,
+                             Widget* parent);
+  static void Layout(const Frame& frame, rhea::variable cursor_line,
+                     Theme* theme, Widget* parent, Widget* content);
   static void RenderLine(DeviceContext* ctx, const Device::Extents& extents,
-                         Theme* theme, ID cursor, int y,
-                         AnnotatedString::LineIterator lit, bool highlight);
+                         Theme* theme, ID cursor,
+                         const CaretSet& secondary_carets, ID find, int y,
+                         int first_column,
+                         AnnotatedString::LineIterator lit, bool highlight,
+                         const AnnotatedString& content,
+                         LineRenderCache* last_frame,
+                         LineRenderCache* this_frame);
+  static bool CanReuse(const LineRender& render, const AnnotatedString& content,
+                       ID line);
+  static bool SameCarets(const LineRender& render, ID cursor,
+                         const CaretSet& secondary_carets);
+  // how a caret at id is drawn (0 for not at all)
+  static unsigned CaretFlags(ID id, ID cursor,
+                             const CaretSet& secondary_carets);
+  static LineRender LayoutLine(const Device::Extents& extents, Theme* theme,
+                               ID cursor, const CaretSet& secondary_carets,
+                               ID find, int first_column, size_t columns,
+                               AnnotatedString::LineIterator lit,
+                               bool highlight, const AnnotatedString& content);
+
+ public:
+  struct Frame {
+    std::string name;
+    bool editable;
+    // if it had the focus (and so took key presses)
+    bool focused;
+    // a line shown under the editor, if not empty
+    std::string status;
+    AnnotatedString content;
+    // ID() if not editable
+    ID cursor;
+    ID line_start;
+    CaretSet secondary_carets;
+    ID find;
+    int first_column;
+    double cursor_line;
+    std::shared_ptr<LineRenderCache> line_renders;
+  };
 
+ private:
   Site* const site_;
   const std::string name_;
   const bool editable_;
@@ -97,15 +241,77 @@ class Editor : public std::enable_shared_from_this<Editor> {
   ID cursor_ = AnnotatedString::Begin();
   ID cursor_reported_ = AnnotatedString::End();
   ID selection_anchor_ = ID();
+  // commands run at each of these too, by swapping it into cursor_ and
+  // selection_anchor_
+  struct SecondaryCursor {
+    ID cursor;
+    ID selection_anchor;
+    bool operator==(const SecondaryCursor& other) const {
+      return cursor == other.cursor &&
+             selection_anchor == other.selection_anchor;
+    }
+    bool operator!=(const SecondaryCursor& other) const {
+      return !operator==(other);
+    }
+  };
+  std::vector<SecondaryCursor> secondary_cursors_;
+  std::vector<SecondaryCursor> secondary_cursors_reported_;
+  bool finding_ = false;
+  LineEditor find_editor_;
+  // C-g: the line number being typed, to go to on return
+  bool going_to_line_ = false;
+  LineEditor line_number_editor_;
+  // the Find holding the query last published, and that query
+  ID find_ = ID();
+  std::string find_published_;
+  CaretSet secondary_carets_ = std::make_shared<std::set<ID>>();
   EditNotification state_;
   CommandSet unpublished_commands_;
-  CommandSet unacknowledged_commands_;
+  // published commands, as the batches they were published in, until the
+  // state reflects them
+  struct UnacknowledgedCommands {
+    CommandSet commands;
+    // integrated along with the rest: see MakeResponse
+    Command probe;
+  };
+  std::deque<UnacknowledgedCommands> unacknowledged_commands_;
+  // pastes still to insert, a chunk at a time
+  std::deque<PendingPaste> pending_pastes_;
+  // a chunk, integrated already: published ahead of unpublished_commands_,
+  // whose cursors may be on it
+  CommandSet pasted_commands_;
   AnnotationEditor ed_;
+  // the id starting each line (as LineIterator reports it), in document
+  // order; rebuilt only when the content's line breaks change
+  class LineIndex {
+   public:
+    const std::vector<ID>& Starts(const AnnotatedString& content);
+
+   private:
+    AnnotatedString content_;
+    std::vector<ID> starts_;
+  };
+  // side buffers (e.g. disassembly) this buffer's BufferRefs point into,
+  // by name: a new version of one is diffed into the same Buffer
   struct BufferInfo {
     std::unique_ptr<Buffer> buffer;
     AnnotationEditor ed;
+    // the Buffer attribute, and contents, last applied
+    ID attr;
+    std::string contents;
+    LineIndex lines;
+    // the lines marked as under the cursor, as last pushed; unset if those
+    // marks need redoing
+    absl::optional<std::vector<int>> marked;
   };
-  std::map<ID, BufferInfo> buffers_;
+  std::map<std::string, BufferInfo> buffers_;
+  // rows shown as of the last layout: how far page-up/page-down move
+  int page_rows_ = 1;
+  // horizontal scroll: the leftmost column shown
+  int first_column_ = 0;
+  std::shared_ptr<LineRenderCache> line_renders_ =
+      std::make_shared<LineRenderCache>();
+  LineIndex line_index_;
 
   // debug values
   struct {
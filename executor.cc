@@ -0,0 +1,70 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "executor.h"
+#include <assert.h>
+
+Executor::Executor(const std::string& name, int threads) : name_(name) {
+  assert(threads > 0);
+  for (int i = 0; i < threads; i++) {
+    threads_.emplace_back([this]() { Work(); });
+  }
+}
+
+Executor::~Executor() {
+  {
+    absl::MutexLock lock(&mu_);
+    shutdown_ = true;
+  }
+  for (auto& t : threads_) t.join();
+}
+
+void Executor::ScheduleAt(absl::Time when, std::function<void()> fn) {
+  absl::MutexLock lock(&mu_);
+  queue_.emplace(when, std::move(fn));
+  scheduled_++;
+}
+
+void Executor::Work() {
+  auto pending = [this]() {
+    mu_.AssertHeld();
+    return !queue_.empty() || shutdown_;
+  };
+  mu_.Lock();
+  for (;;) {
+    if (queue_.empty()) {
+      if (shutdown_) break;
+      mu_.Await(absl::Condition(&pending));
+      continue;
+    }
+    const absl::Time next = queue_.begin()->first;
+    if (next > absl::Now()) {
+      // nothing left that's due
+      if (shutdown_) break;
+      // sleep until it is, or something earlier arrives
+      const uint64_t seen = scheduled_;
+      auto changed = [this, seen]() {
+        mu_.AssertHeld();
+        return shutdown_ || scheduled_ != seen;
+      };
+      mu_.AwaitWithDeadline(absl::Condition(&changed), next);
+      continue;
+    }
+    std::function<void()> fn = std::move(queue_.begin()->second);
+    queue_.erase(queue_.begin());
+    mu_.Unlock();
+    fn();
+    mu_.Lock();
+  }
+  mu_.Unlock();
+}
@@ -0,0 +1,50 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+// A fixed set of threads running closures handed to it: work that must not
+// happen on the thread that has it (because that thread must never block)
+// goes here rather than to a thread of its own. Closures run in the order
+// they're due, but with more than one thread, may overlap: callers needing
+// order sequence their own work.
+class Executor {
+ public:
+  Executor(const std::string& name, int threads);
+  // runs whatever is already due, drops the rest, and joins the threads
+  ~Executor();
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  void Schedule(std::function<void()> fn) { ScheduleAt(absl::Now(), fn); }
+  void ScheduleAt(absl::Time when, std::function<void()> fn);
+
+ private:
+  void Work();
+
+  const std::string name_;
+  absl::Mutex mu_;
+  std::multimap<absl::Time, std::function<void()>> queue_ GUARDED_BY(mu_);
+  // counts calls to ScheduleAt, so that sleepers notice new arrivals
+  uint64_t scheduled_ GUARDED_BY(mu_) = 0;
+  bool shutdown_ GUARDED_BY(mu_) = false;
+  std::vector<std::thread> threads_;
+};
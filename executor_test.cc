@@ -0,0 +1,34 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "executor.h"
+#include "gtest/gtest.h"
+
+TEST(Executor, RunsInOrderDue) {
+  absl::Mutex mu;
+  std::vector<int> ran;
+  {
+    Executor executor("test", 1);
+    const absl::Time now = absl::Now();
+    for (int i : {3, 1, 2}) {
+      executor.ScheduleAt(now + absl::Milliseconds(10 * i), [&, i]() {
+        absl::MutexLock lock(&mu);
+        ran.push_back(i);
+      });
+    }
+    auto all_ran = [&]() { return ran.size() == 3; };
+    absl::MutexLock lock(&mu);
+    mu.Await(absl::Condition(&all_ran));
+  }
+  EXPECT_EQ(ran, std::vector<int>({1, 2, 3}));
+}
@@ -0,0 +1,240 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <gflags/gflags.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+#include "absl/synchronization/mutex.h"
+#include "buffer.h"
+#include "log.h"
+
+DEFINE_int32(find_lines_per_update, 2000,
+             "Lines searched for a new find before publishing what's been "
+             "found so far (the lines around the cursor go first)");
+
+namespace {
+
+// the lines commands could have changed the text of, by the id starting
+// each (as LineIterator reports it)
+void TouchedLines(const AnnotatedString& content, const CommandSet& commands,
+                  std::set<ID>* lines) {
+  for (const auto& cmd : commands.commands()) {
+    switch (cmd.command_case()) {
+      case Command::kInsert: {
+        const auto& chars = cmd.insert().characters();
+        if (chars.empty()) break;
+        ID last(cmd.id());
+        last.clock += chars.size() - 1;
+        const ID last_line = AnnotatedString::LineIterator(content, last).id();
+        AnnotatedString::LineIterator line(content, cmd.insert().after());
+        for (;;) {
+          lines->insert(line.id());
+          if (line.id() == last_line || !line.MoveNext()) break;
+        }
+        break;
+      }
+      case Command::kDelete:
+        // if it was a line break, its line is gone too
+        lines->insert(cmd.id());
+        lines->insert(AnnotatedString::LineIterator(content, cmd.id()).id());
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+}  // namespace
+
+// Marks where the query of its own site's editor's Find occurs, on this
+// collaborator's pull thread. Queries don't span lines, so matches are kept
+// per line: a new query is searched for a batch of lines at a time, from the
+// editor's cursor outwards, and edits afterwards only have the lines they
+// touch searched again.
+class FindCollaborator final : public AsyncCommandCollaborator {
+ public:
+  FindCollaborator(const Buffer* buffer)
+      : AsyncCommandCollaborator("find", absl::Seconds(0), absl::Seconds(0)),
+        buffer_(buffer) {}
+
+  void Push(const CommandSet* commands) override {
+    absl::MutexLock lock(&mu_);
+    if (commands == nullptr) {
+      shutdown_ = true;
+    } else {
+      changed_.MergeFrom(*commands);
+    }
+  }
+
+  bool Pull(CommandSet* commands) override {
+    commands->Clear();
+    CommandSet changed;
+    {
+      absl::MutexLock lock(&mu_);
+      if (unsearched_.empty()) {
+        mu_.Await(absl::Condition(this, &FindCollaborator::HasWork));
+      }
+      if (shutdown_) return false;
+      changed.Swap(&changed_);
+    }
+
+    // at least as new as every change pushed so far
+    const AnnotatedString content = buffer_->ContentSnapshot();
+    ID find;
+    std::string query;
+    content.ForEachAttribute(
+        Attribute::kFind, [&](ID id, const Attribute& attr) {
+          if (!buffer_->site()->CreatedID(id)) return;
+          find = id;
+          query = attr.find().query();
+        });
+    if (find != find_) {
+      Restart(content, find, query, commands);
+    } else if (find_ != ID()) {
+      std::set<ID> touched;
+      TouchedLines(content, changed, &touched);
+      for (ID line : touched) Search(content, line, commands);
+    }
+    for (int i = 0; i < FLAGS_find_lines_per_update && !unsearched_.empty();
+         i++) {
+      Search(content, unsearched_.front(), commands);
+      unsearched_.pop_front();
+    }
+    return true;
+  }
+
+ private:
+  bool HasWork() const EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return shutdown_ || !changed_.commands().empty();
+  }
+
+  struct Match {
+    ID begin;
+    ID end;
+    ID mark;
+  };
+
+  void Restart(const AnnotatedString& content, ID find,
+               const std::string& query, CommandSet* commands) {
+    for (const auto& line : matches_) {
+      for (const auto& match : line.second) {
+        AnnotatedString::MakeDelMark(commands, match.mark);
+      }
+    }
+    if (match_attr_ != ID()) {
+      AnnotatedString::MakeDelDecl(commands, match_attr_);
+      match_attr_ = ID();
+    }
+    matches_.clear();
+    unsearched_.clear();
+    find_ = find;
+    query_ = query;
+    if (find_ == ID() || query_.empty()) return;
+
+    Attribute attr;
+    attr.mutable_find_match()->set_find(find_.id);
+    match_attr_ = AnnotatedString::MakeDecl(commands, buffer_->site(), attr);
+
+    // the lines in view go first: outwards from our editor's cursor
+    ID cursor = AnnotatedString::Begin();
+    content.ForEachAnnotation(
+        Attribute::kCursor,
+        [&](ID id, ID begin, ID end, const Attribute& attr) {
+          if (buffer_->site()->CreatedID(id)) cursor = begin;
+        });
+    AnnotatedString::LineIterator up(content, cursor);
+    AnnotatedString::LineIterator down = up;
+    unsearched_.push_back(up.id());
+    for (bool more = true; more;) {
+      more = false;
+      if (up.MovePrev()) {
+        unsearched_.push_back(up.id());
+        more = true;
+      }
+      if (down.MoveNext() && !down.is_end()) {
+        unsearched_.push_back(down.id());
+        more = true;
+      }
+    }
+  }
+
+  // bring the marks on the line starting at line up to date
+  void Search(const AnnotatedString& content, ID line, CommandSet* commands) {
+    std::vector<Match> found;
+    if (AnnotatedString::LineIterator(content, line).id() == line) {
+      // the line's text, and the id of each character (and of what ends it)
+      std::string text;
+      std::vector<ID> ids;
+      AnnotatedString::Iterator it(content, line);
+      for (;;) {
+        it.MoveNext();
+        ids.push_back(it.id());
+        if (it.is_end() || it.value() == '\n') break;
+        text += it.value();
+      }
+      for (size_t pos = text.find(query_); pos != std::string::npos;
+           pos = text.find(query_, pos + query_.size())) {
+        found.push_back(Match{ids[pos], ids[pos + query_.size()], ID()});
+      }
+    }
+
+    auto it = matches_.find(line);
+    std::vector<Match> was;
+    if (it != matches_.end()) was.swap(it->second);
+    for (auto& match : found) {
+      auto same = std::find_if(was.begin(), was.end(), [&](const Match& m) {
+        return m.begin == match.begin && m.end == match.end;
+      });
+      if (same != was.end()) {
+        match.mark = same->mark;
+        was.erase(same);
+      } else {
+        Annotation anno;
+        anno.set_begin(match.begin.id);
+        anno.set_end(match.end.id);
+        anno.set_attribute(match_attr_.id);
+        match.mark =
+            AnnotatedString::MakeMark(commands, buffer_->site(), anno);
+      }
+    }
+    for (const auto& match : was) {
+      AnnotatedString::MakeDelMark(commands, match.mark);
+    }
+    if (found.empty()) {
+      if (it != matches_.end()) matches_.erase(it);
+    } else {
+      matches_[line].swap(found);
+    }
+  }
+
+  const Buffer* const buffer_;
+  absl::Mutex mu_;
+  bool shutdown_ GUARDED_BY(mu_) = false;
+  // pushed, and not yet looked at
+  CommandSet changed_ GUARDED_BY(mu_);
+
+  // only touched by Pull
+  ID find_ = ID();
+  std::string query_;
+  // the FindMatch our marks carry
+  ID match_attr_ = ID();
+  // by line start
+  std::map<ID, std::vector<Match>> matches_;
+  // line starts still to be searched for a new query
+  std::deque<ID> unsearched_;
+};
+
+CLIENT_COLLABORATOR(FindCollaborator, buffer) { return !buffer->synthetic(); }
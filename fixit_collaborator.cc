@@ -45,4 +45,6 @@ EditResponse FixitCollaborator::Edit(const EditNotification& notification) {
   return response;
 }
 
-SERVER_COLLABORATOR(FixitCollaborator, buffer) { return !buffer->read_only(); }
+LAZY_SERVER_COLLABORATOR(FixitCollaborator, kStartOnListener, buffer) {
+  return !buffer->read_only();
+}
@@ -97,7 +97,8 @@ EditResponse GodboltCollaborator::Edit(const EditNotification& notification) {
   return response;
 }
 
-SERVER_COLLABORATOR(GodboltCollaborator, buffer) {
+LAZY_SERVER_COLLABORATOR(GodboltCollaborator,
+                         kStartOnListener | kStartOnLoaded, buffer) {
   auto fext = buffer->filename().extension();
   for (auto mext :
        {".c", ".cxx", ".cpp", ".C", ".cc", ".h", ".H", ".hpp", ".hxx"}) {
@@ -0,0 +1,85 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "histogram.h"
+#include <algorithm>
+#include "absl/strings/str_cat.h"
+
+static int BucketFor(uint64_t value) {
+  int bucket = 0;
+  while (value) {
+    bucket++;
+    value >>= 1;
+  }
+  return bucket;
+}
+
+static uint64_t BucketLimit(int bucket) {
+  if (bucket == 0) return 0;
+  if (bucket >= 64) return UINT64_MAX;
+  return (uint64_t(1) << bucket) - 1;
+}
+
+void Histogram::Add(uint64_t value) {
+  buckets_[BucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::ToProto(HistogramMsg* msg) const {
+  msg->Clear();
+  int last = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    if (buckets_[i].load(std::memory_order_relaxed)) last = i + 1;
+  }
+  for (int i = 0; i < last; i++) {
+    msg->add_buckets(buckets_[i].load(std::memory_order_relaxed));
+  }
+  msg->set_count(count_.load(std::memory_order_relaxed));
+  msg->set_sum(sum_.load(std::memory_order_relaxed));
+  msg->set_max(max_.load(std::memory_order_relaxed));
+}
+
+void MergeHistogram(const HistogramMsg& from, HistogramMsg* into) {
+  while (into->buckets_size() < from.buckets_size()) into->add_buckets(0);
+  for (int i = 0; i < from.buckets_size(); i++) {
+    into->set_buckets(i, into->buckets(i) + from.buckets(i));
+  }
+  into->set_count(into->count() + from.count());
+  into->set_sum(into->sum() + from.sum());
+  into->set_max(std::max(into->max(), from.max()));
+}
+
+uint64_t HistogramQuantile(const HistogramMsg& msg, double q) {
+  if (msg.count() == 0) return 0;
+  const double target = q * msg.count();
+  uint64_t seen = 0;
+  for (int i = 0; i < msg.buckets_size(); i++) {
+    seen += msg.buckets(i);
+    if (seen >= target && seen > 0) {
+      return std::min(BucketLimit(i), msg.max());
+    }
+  }
+  return msg.max();
+}
+
+std::string HistogramSummary(const HistogramMsg& msg) {
+  return absl::StrCat("n=", msg.count(), " p50=", HistogramQuantile(msg, 0.5),
+                      " p90=", HistogramQuantile(msg, 0.9),
+                      " p99=", HistogramQuantile(msg, 0.99),
+                      " max=", msg.max());
+}
@@ -0,0 +1,49 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "proto/profile.pb.h"
+
+// Lock-free histogram of non-negative samples with power-of-two buckets.
+class Histogram {
+ public:
+  static constexpr int kBuckets = 65;
+
+  Histogram() {}
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void Add(uint64_t value);
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+  void ToProto(HistogramMsg* msg) const;
+
+ private:
+  std::atomic<uint64_t> buckets_[kBuckets] = {};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+void MergeHistogram(const HistogramMsg& from, HistogramMsg* into);
+
+// upper bound of the bucket containing the q'th quantile (0 <= q <= 1)
+uint64_t HistogramQuantile(const HistogramMsg& msg, double q);
+
+// one line summary: "n=.. p50=.. p90=.. p99=.. max=.."
+std::string HistogramSummary(const HistogramMsg& msg);
@@ -0,0 +1,53 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "histogram.h"
+#include <gtest/gtest.h>
+
+TEST(HistogramTest, Empty) {
+  Histogram h;
+  HistogramMsg msg;
+  h.ToProto(&msg);
+  EXPECT_EQ(0, msg.count());
+  EXPECT_EQ(0, msg.buckets_size());
+  EXPECT_EQ(0, HistogramQuantile(msg, 0.5));
+}
+
+TEST(HistogramTest, Quantiles) {
+  Histogram h;
+  for (int i = 1; i <= 100; i++) h.Add(i);
+  HistogramMsg msg;
+  h.ToProto(&msg);
+  EXPECT_EQ(100, msg.count());
+  EXPECT_EQ(5050, msg.sum());
+  EXPECT_EQ(100, msg.max());
+  // 50 lands in [32, 64), 99 lands in [64, 128) capped by the max sample
+  EXPECT_EQ(63, HistogramQuantile(msg, 0.5));
+  EXPECT_EQ(100, HistogramQuantile(msg, 0.99));
+}
+
+TEST(HistogramTest, Merge) {
+  Histogram a, b;
+  a.Add(0);
+  a.Add(3);
+  b.Add(1000);
+  HistogramMsg ma, mb;
+  a.ToProto(&ma);
+  b.ToProto(&mb);
+  MergeHistogram(mb, &ma);
+  EXPECT_EQ(3, ma.count());
+  EXPECT_EQ(1003, ma.sum());
+  EXPECT_EQ(1000, ma.max());
+  EXPECT_EQ(0, HistogramQuantile(ma, 0.3));
+  EXPECT_EQ(1000, HistogramQuantile(ma, 1.0));
+}
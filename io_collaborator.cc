@@ -39,12 +39,21 @@ IOCollaborator::IOCollaborator(const Buffer* buffer)
     : AsyncCollaborator("io", absl::Milliseconds(100), absl::Milliseconds(500)),
       buffer_(buffer),
       last_char_id_(AnnotatedString::Begin()) {
+  struct stat st;
+  WrapSyscall("stat", [&]() {
+    return stat(buffer_->filename().string().c_str(), &st);
+  });
+  attributes_ = st.st_mode;
+  if (buffer_->initially_loaded()) {
+    // restored from a snapshot of what we last saved: nothing to read, and
+    // nothing to write until it changes
+    fd_ = -1;
+    last_saved_ = buffer_->ContentSnapshot();
+    return;
+  }
   fd_ = WrapSyscall("open", [this]() {
     return open(buffer_->filename().string().c_str(), O_RDONLY);
   });
-  struct stat st;
-  WrapSyscall("fstat", [&]() { return fstat(fd_, &st); });
-  attributes_ = st.st_mode;
 }
 
 void IOCollaborator::Push(const EditNotification& notification) {
@@ -69,13 +78,17 @@ void IOCollaborator::Push(const EditNotification& notification) {
 }
 
 EditResponse IOCollaborator::Pull() {
+  EditResponse r;
+  if (fd_ < 0) {
+    r.done = true;
+    return r;
+  }
+
   static constexpr const int kChunkSize = 4096;
   char buf[kChunkSize];
   const int n = WrapSyscall(
       "read", [this, &buf]() { return read(fd_, buf, sizeof(buf)); });
 
-  EditResponse r;
-
   if (n != sizeof(buf)) {
     r.done = true;
     r.become_loaded = true;
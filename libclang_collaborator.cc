@@ -455,7 +455,8 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
   return response;
 }
 
-SERVER_COLLABORATOR(LibClangCollaborator, buffer) {
+LAZY_SERVER_COLLABORATOR(LibClangCollaborator,
+                         kStartOnListener | kStartOnLoaded, buffer) {
   ClangEnv* env = buffer->project()->aspect<ClangEnv>();
   if (env == nullptr) return false;
   auto fext = buffer->filename().extension();
@@ -57,6 +57,13 @@ class LineEditor {
     cursor_++;
   }
 
+  const std::string& text() const { return text_; }
+  void Clear() {
+    text_.clear();
+    cursor_ = 0;
+    sel_anchor_ = -1;
+  }
+
   template <class RC>
   void Render(RC* rc) {
     rc->Put(0, 0, text_, rc->color({}, 0));
@@ -86,4 +86,8 @@ void ReferencedFileCollaborator::RestartWatch() {
       interest_vec, [this](bool shutdown) { ChangedFile(shutdown); }));
 }
 
-SERVER_COLLABORATOR(ReferencedFileCollaborator, buffer) { return true; }
+// watches files that libclang reports as dependencies
+LAZY_SERVER_COLLABORATOR(ReferencedFileCollaborator, kStartOnListener,
+                         buffer) {
+  return true;
+}
@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "run.h"
+#include <fcntl.h>
 #include <string.h>
 #include <sys/dir.h>
 #include <sys/types.h>
@@ -141,8 +142,8 @@ RunResult run(const boost::filesystem::path& command,
   }
 }
 
-void run_daemon(const boost::filesystem::path& command,
-                const std::vector<std::string>& args) {
+pid_t run_daemon(const boost::filesystem::path& command,
+                 const std::vector<std::string>& args, int pass_fd) {
   Log() << "RUN DAEMON: "
         << absl::StrCat(command.string(), " ", absl::StrJoin(args, " "));
 
@@ -159,8 +160,16 @@ void run_daemon(const boost::filesystem::path& command,
     WrapSyscall("dup2", [&]() { return dup2(wrf, STDOUT_FILENO); });
     WrapSyscall("dup2", [&]() { return dup2(wrf, STDERR_FILENO); });
 #endif
-    CloseFDsAfter(STDERR_FILENO);
+    const int last_fd = pass_fd < 0 ? STDERR_FILENO : STDERR_FILENO + 1;
+    if (pass_fd == last_fd) {
+      // dup2 would leave it as is, close-on-exec included
+      WrapSyscall("fcntl", [&]() { return fcntl(pass_fd, F_SETFD, 0); });
+    } else if (pass_fd >= 0) {
+      WrapSyscall("dup2", [&]() { return dup2(pass_fd, last_fd); });
+    }
+    CloseFDsAfter(last_fd);
     execvp(cargs[0], cargs.data());
     abort();
   }
+  return p;
 }
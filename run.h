@@ -13,6 +13,7 @@
 // limitations under the License.
 #pragma once
 
+#include <sys/types.h>
 #include <boost/filesystem/path.hpp>
 #include <string>
 #include <vector>
@@ -26,5 +27,7 @@ struct RunResult {
 RunResult run(const boost::filesystem::path& command,
               const std::vector<std::string>& args, const std::string& input);
 
-void run_daemon(const boost::filesystem::path& command,
-                const std::vector<std::string>& args);
+// starts command in the background and returns its pid; pass_fd (if set) is
+// inherited by it as descriptor 3, every other one is closed
+pid_t run_daemon(const boost::filesystem::path& command,
+                 const std::vector<std::string>& args, int pass_fd = -1);
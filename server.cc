@@ -12,22 +12,228 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "server.h"
+#include <gflags/gflags.h>
 #include <grpc++/security/server_credentials.h>
 #include <grpc++/server.h>
 #include <grpc++/server_builder.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <fstream>
 #include <map>
+#include <set>
+#include <thread>
+#include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/types/optional.h"
 #include "application.h"
+#include "broadcast.h"
 #include "buffer.h"
+#include "executor.h"
 #include "log.h"
 #include "proto/project_service.grpc.pb.h"
+#include "proto/snapshot.pb.h"
 #include "run.h"
+#include "shm_channel.h"
 #include "src_hash.h"
+#include "wrap_syscall.h"
 
-class ProjectServer : public Application, public ProjectService::Service {
+DEFINE_int32(server_max_buffers, 64,
+             "Number of buffers the project server keeps loaded before "
+             "evicting the least recently used idle ones to disk");
+DEFINE_int64(server_max_buffer_memory_mb, 1024,
+             "Approximate memory budget for loaded buffers; above it the "
+             "least recently used idle buffers are evicted to disk");
+DEFINE_int32(edit_initial_chunk_bytes, 256 << 10,
+             "Size of the messages a buffer's initial state is streamed to "
+             "an edit session in");
+DEFINE_int64(edit_initial_state_cache_mb, 64,
+             "Largest serialized buffer state kept for reuse by the next "
+             "edit session to attach to an unchanged buffer");
+DEFINE_int32(server_polling_threads, 4,
+             "Threads servicing the project server's completion queue");
+DEFINE_int32(server_session_threads, 8,
+             "Threads edit sessions hand work that may block to: applying "
+             "a client's commands, and attaching to and detaching from "
+             "buffers");
+DEFINE_int32(edit_max_outbox_bytes, 4 << 20,
+             "Bytes of buffer updates an edit session may have waiting for "
+             "its client; one that falls further behind is cancelled");
+DEFINE_int32(edit_resume_grace_ms, 5000,
+             "How long a dropped edit session may be resumed before its "
+             "cursors and other attributes are removed");
+DEFINE_int32(server_ready_fd, -1,
+             "(Internal) descriptor to signal once the server is accepting "
+             "connections: see SpawnServer");
+DEFINE_int32(server_start_timeout_ms, 10000,
+             "How long the client waits for a server it spawned to start");
+DEFINE_bool(server_standby, false,
+            "Keep a started server per project waiting to take over when "
+            "the running one exits, so the next client needn't wait for one "
+            "to start");
+DEFINE_bool(server_is_standby, false,
+            "(Internal) wait for the project's running server to exit, "
+            "then take over from it");
+
+// arguments starting a project server; role names its log
+static std::vector<std::string> ServerArgs(const Project& project,
+                                           const char* role,
+                                           std::vector<std::string> flags) {
+  const auto address = project.aspect<ProjectRoot>()->LocalAddressPath();
+  flags.insert(flags.begin(),
+               {"-mode", "ProjectServer", "-logfile",
+                (address.parent_path() /
+                 absl::StrCat(".cedlog.", role, ".", ced_src_hash))
+                    .string()});
+  flags.push_back(address.string());
+  return flags;
+}
+
+// takes an exclusive lock on path, held until the returned descriptor is
+// closed (or we exit): -1 if someone else holds it and wait is false
+static int LockFile(const boost::filesystem::path& path, bool wait) {
+  const int fd = WrapSyscall("open", [&]() {
+    return open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  });
+  int r;
+  while ((r = flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB))) == -1 &&
+         errno == EINTR) {
+  }
+  if (r == -1) {
+    const int e = errno;
+    close(fd);
+    if (e == EWOULDBLOCK) return -1;
+    throw std::runtime_error(
+        absl::StrCat("flock failed: errno=", e, " ", strerror(e)));
+  }
+  return fd;
+}
+
+// Where a server writes snapshots of the buffers it evicts. They're only
+// meaningful to the process that wrote them (the site ids they contain may
+// be reissued by another), so each server has a directory of its own, under
+// the user's cache directory rather than the project: a standby server for
+// the same project mustn't see or remove them. Removed with the server.
+class SnapshotDir {
+ public:
+  explicit SnapshotDir(const boost::filesystem::path& project_root) {
+    boost::filesystem::path cache;
+    if (const char* xdg = getenv("XDG_CACHE_HOME")) {
+      cache = xdg;
+    } else if (const char* home = getenv("HOME")) {
+      cache = boost::filesystem::path(home) / ".cache";
+    } else {
+      cache = "/tmp";
+    }
+    path_ = cache / "ced" / "snapshots" /
+            absl::StrCat(std::hash<std::string>()(project_root.string())) /
+            absl::StrCat(getpid());
+    // left by a process that had our pid and didn't live to clean up
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(path_, ec);
+    boost::filesystem::create_directories(path_, ec);
+    if (ec) {
+      Log() << "Failed creating snapshot directory " << path_ << ": "
+            << ec.message();
+    }
+  }
+
+  ~SnapshotDir() {
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(path_, ec);
+    // and the project's directory, once no other server has one there
+    boost::filesystem::remove(path_.parent_path(), ec);
+  }
+
+  SnapshotDir(const SnapshotDir&) = delete;
+  SnapshotDir& operator=(const SnapshotDir&) = delete;
+
+  const boost::filesystem::path& path() const { return path_; }
+
+ private:
+  boost::filesystem::path path_;
+};
+
+// A buffer's state serialized as the chunks sent to new edit sessions,
+// memoized for the content it was built from: sessions attaching while the
+// buffer is unchanged reuse the bytes rather than walking and serializing
+// every character, attribute and annotation again.
+class InitialStateCache {
+ public:
+  typedef std::shared_ptr<const std::string> Chunk;
+
+  // calls f with each chunk of content, in order: as each is built, unless
+  // they're cached
+  void ForEachChunk(const AnnotatedString& content,
+                    const std::function<void(const Chunk&)>& f) {
+    std::vector<Chunk> cached;
+    {
+      absl::MutexLock lock(&mu_);
+      if (content_ && content_->SameTotalIdentity(content)) cached = chunks_;
+    }
+    if (!cached.empty()) {
+      for (const auto& chunk : cached) f(chunk);
+      return;
+    }
+    const size_t max_bytes =
+        static_cast<size_t>(FLAGS_edit_initial_state_cache_mb) << 20;
+    std::vector<Chunk> built;
+    size_t bytes = 0;
+    content.AsCommandChunks(FLAGS_edit_initial_chunk_bytes,
+                            [&](CommandSet* commands) {
+                              auto chunk = std::make_shared<std::string>();
+                              commands->SerializeToString(chunk.get());
+                              bytes += chunk->size();
+                              if (bytes <= max_bytes) built.push_back(chunk);
+                              f(chunk);
+                            });
+    absl::MutexLock lock(&mu_);
+    if (bytes > max_bytes) return;
+    content_ = content;
+    chunks_.swap(built);
+    bytes_ = bytes;
+  }
+
+  size_t bytes() {
+    absl::MutexLock lock(&mu_);
+    return bytes_;
+  }
+
+ private:
+  absl::Mutex mu_;
+  absl::optional<AnnotatedString> content_ GUARDED_BY(mu_);
+  std::vector<Chunk> chunks_ GUARDED_BY(mu_);
+  size_t bytes_ GUARDED_BY(mu_) = 0;
+};
+
+// ProjectService, with Edit's responses written as bytes we serialize
+// ourselves: see EditMessageBuffer
+class Service : public ProjectService::AsyncService {
+ public:
+  void RequestRawEdit(
+      grpc::ServerContext* context,
+      grpc::ServerAsyncReaderWriter<grpc::ByteBuffer, EditMessage>* stream,
+      grpc::CompletionQueue* new_call_cq,
+      grpc::ServerCompletionQueue* notification_cq, void* tag) {
+    // as RequestEdit: the index is Edit's position in the service
+    RequestAsyncBidiStreaming(1, context, stream, new_call_cq, notification_cq,
+                              tag);
+  }
+};
+
+class ProjectServer : public Application {
  public:
   ProjectServer(int argc, char** argv)
-      : project_(PathFromArgs(argc, argv), false),
+      : ced_bin_(argv[0]),
+        project_(PathFromArgs(argc, argv), false),
+        snapshots_(project_.aspect<ProjectRoot>()->Path()),
         active_requests_(0),
         last_activity_(absl::Now()),
         quit_requested_(false) {
@@ -38,15 +244,62 @@ class ProjectServer : public Application, public ProjectService::Service {
           project_.aspect<ProjectRoot>()->LocalAddressPath().string()));
     }
 
-    server_ =
-        grpc::ServerBuilder()
-            .RegisterService(this)
-            .AddListeningPort(project_.aspect<ProjectRoot>()->LocalAddress(),
-                              grpc::InsecureServerCredentials())
-            .BuildAndStart();
+    // one server per project: the lock is held until we exit, however that
+    // happens, which is what a standby waits for
+    const auto root = project_.aspect<ProjectRoot>()->Path();
+    if (FLAGS_server_is_standby) {
+      const int standby_lock = LockFile(root / ".cedport.standby", false);
+      if (standby_lock < 0) {
+        throw std::runtime_error("Project already has a standby server");
+      }
+      Log() << "Standing by for " << root;
+      LockFile(root / ".cedport.lock", true);
+      close(standby_lock);
+      Log() << "Taking over from the previous server";
+      // the previous server may not have lived to clean up after itself
+      boost::filesystem::remove(
+          project_.aspect<ProjectRoot>()->LocalAddressPath());
+      absl::MutexLock lock(&mu_);
+      last_activity_ = absl::Now();
+    } else if (LockFile(root / ".cedport.lock", false) < 0) {
+      throw std::runtime_error("Project already has a server");
+    }
+
+    grpc::ServerBuilder builder;
+    builder.RegisterService(&service_).AddListeningPort(
+        project_.aspect<ProjectRoot>()->LocalAddress(),
+        grpc::InsecureServerCredentials());
+    cq_ = builder.AddCompletionQueue();
+    server_ = builder.BuildAndStart();
+    if (!server_) {
+      throw std::runtime_error(
+          absl::StrCat("Unable to listen on ",
+                       project_.aspect<ProjectRoot>()->LocalAddress()));
+    }
+
+    UnaryCall<ConnectionHelloRequest, ConnectionHelloResponse>::Await(
+        this, &ProjectService::AsyncService::RequestConnectionHello,
+        &ProjectServer::ConnectionHello);
+    UnaryCall<Empty, Empty>::Await(this,
+                                   &ProjectService::AsyncService::RequestQuit,
+                                   &ProjectServer::Quit);
+    UnaryCall<ProfileRequest, ProfileResponse>::Await(
+        this, &ProjectService::AsyncService::RequestProfile,
+        &ProjectServer::Profile);
+    EditSession::Await(this);
+    for (int i = 0; i < FLAGS_server_polling_threads; i++) {
+      polling_threads_.emplace_back([this]() { Poll(); });
+    }
 
     Log() << "Created server " << server_.get() << " @ "
           << project_.aspect<ProjectRoot>()->LocalAddress();
+    if (FLAGS_server_ready_fd >= 0) {
+      const char ready = 1;
+      WrapSyscall("write", [&]() {
+        return write(FLAGS_server_ready_fd, &ready, sizeof(ready));
+      });
+      close(FLAGS_server_ready_fd);
+    }
   }
 
   int Run() override {
@@ -56,86 +309,600 @@ class ProjectServer : public Application, public ProjectService::Service {
              (quit_requested_ ||
               (absl::Now() - last_activity_ > absl::Hours(1)));
     };
+    for (;;) {
+      {
+        absl::MutexLock lock(&mu_);
+        if (mu_.AwaitWithTimeout(absl::Condition(&done),
+                                 absl::Duration(absl::Minutes(1)))) {
+          break;
+        }
+      }
+      // buffers grow as collaborators annotate them, not just when opened
+      EvictIdleBuffers();
+    }
+    pid_t standby = 0;
     {
       absl::MutexLock lock(&mu_);
-      while (!mu_.AwaitWithTimeout(absl::Condition(&done),
-                                   absl::Duration(absl::Minutes(1))))
-        ;
+      ReapStandby();
+      // a client asking us to quit wants a fresh server, not our standby
+      if (quit_requested_) standby = standby_pid_;
+    }
+    if (standby > 0) {
+      kill(standby, SIGTERM);
+      waitpid(standby, nullptr, 0);
     }
     server_->Shutdown();
+    // the queue must be drained after the server stops producing events for
+    // it: calls still waiting to arrive complete (unsuccessfully) here
+    cq_->Shutdown();
+    for (auto& t : polling_threads_) t.join();
     return 0;
   }
 
-  grpc::Status ConnectionHello(grpc::ServerContext* context,
-                               const ConnectionHelloRequest* req,
-                               ConnectionHelloResponse* rsp) override {
+ private:
+  grpc::Status ConnectionHello(const ConnectionHelloRequest& req,
+                               ConnectionHelloResponse* rsp) {
     rsp->set_src_hash(ced_src_hash);
+    if (FLAGS_server_standby) MaybeSpawnStandby();
     return grpc::Status::OK;
   }
 
-  grpc::Status Quit(grpc::ServerContext* context, const Empty* req,
-                    Empty* rsp) override {
+  // spawned once a client shows up rather than at startup: a server that
+  // took over from an idle one, and idles out itself, leaves none behind
+  void MaybeSpawnStandby() {
+    {
+      absl::MutexLock lock(&mu_);
+      if (standby_spawned_) {
+        ReapStandby();
+        return;
+      }
+      standby_spawned_ = true;
+    }
+    // forking a process this size takes a while: not under mu_
+    const pid_t pid =
+        run_daemon(ced_bin_, ServerArgs(project_, "standby",
+                                        {"-server_standby",
+                                         "-server_is_standby"}));
+    absl::MutexLock lock(&mu_);
+    standby_pid_ = pid;
+  }
+
+  // a standby that exits while we're running (another server's standby may
+  // hold the lock already) isn't replaced, but mustn't linger as a zombie
+  void ReapStandby() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (standby_pid_ > 0 &&
+        waitpid(standby_pid_, nullptr, WNOHANG) == standby_pid_) {
+      Log() << "Standby server " << standby_pid_ << " exited";
+      standby_pid_ = 0;
+    }
+  }
+
+  grpc::Status Quit(const Empty& req, Empty* rsp) {
     absl::MutexLock lock(&mu_);
     quit_requested_ = true;
     return grpc::Status::OK;
   }
 
-  grpc::Status Edit(
-      grpc::ServerContext* context,
-      grpc::ServerReaderWriter<EditMessage, EditMessage>* stream) override {
-    ScopedRequest scoped_request(this);
-    EditMessage msg;
-    if (!stream->Read(&msg)) {
-      return grpc::Status(grpc::INVALID_ARGUMENT,
-                          "Stream closed with no greeting");
-    }
-    if (msg.type_case() != EditMessage::kClientHello) {
-      return grpc::Status(grpc::INVALID_ARGUMENT,
-                          "First message from client must be ClientHello");
-    }
-    Buffer* buffer = GetBuffer(msg.client_hello().buffer_name());
-    if (!buffer) {
-      return grpc::Status(grpc::INVALID_ARGUMENT,
-                          "Unable to access requested buffer");
-    }
-    Site site;
-    auto listener = buffer->Listen(
-        [stream, &site](const AnnotatedString& initial) {
-          EditMessage out;
-          auto body = out.mutable_server_hello();
-          body->set_site_id(site.site_id());
-          *body->mutable_current_state() = initial.AsProto();
-          stream->Write(out);
-        },
-        [stream](const CommandSet* commands) {
-          EditMessage out;
-          *out.mutable_commands() = *commands;
-          stream->Write(out);
-        });
-    while (stream->Read(&msg)) {
-      if (msg.type_case() != EditMessage::kCommands) {
-        return grpc::Status(grpc::INVALID_ARGUMENT,
-                            "Expected commands after greetings");
+  grpc::Status Profile(const ProfileRequest& req, ProfileResponse* rsp) {
+    std::vector<std::shared_ptr<Buffer>> buffers;
+    {
+      absl::MutexLock lock(&mu_);
+      for (const auto& b : buffers_) {
+        if (req.buffer_name().empty() ||
+            b.first == boost::filesystem::absolute(req.buffer_name())) {
+          buffers.push_back(b.second.buffer);
+        }
+      }
+    }
+    std::map<std::string, CollaboratorProfile> project;
+    auto* process = rsp->mutable_process();
+    for (const auto& buffer : buffers) {
+      process->set_buffer_bytes(process->buffer_bytes() +
+                                buffer->ApproximateMemoryUsage());
+      BufferProfile* profile = rsp->add_buffers();
+      buffer->Profile(profile);
+      for (const auto& c : profile->collaborators()) {
+        MergeCollaboratorProfile(c, &project[c.name()]);
       }
-      buffer->PushChanges(&msg.commands(), true);
     }
-    CommandSet cleanup_commands;
-    buffer->ContentSnapshot().MakeDeleteAttributesBySite(&cleanup_commands,
-                                                         site);
-    buffer->PushChanges(&msg.commands(), false);
+    for (const auto& c : project) {
+      *rsp->add_project() = c.second;
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+      auto us = [](const timeval& tv) {
+        return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+      };
+      process->set_user_cpu_us(us(usage.ru_utime));
+      process->set_system_cpu_us(us(usage.ru_stime));
+#ifdef __APPLE__
+      process->set_max_rss_bytes(usage.ru_maxrss);
+#else
+      process->set_max_rss_bytes(static_cast<uint64_t>(usage.ru_maxrss) << 10);
+#endif
+    }
     return grpc::Status::OK;
   }
 
- private:
+  class ScopedRequest {
+   public:
+    explicit ScopedRequest(ProjectServer* p) : p_(p) {
+      absl::MutexLock lock(&p_->mu_);
+      p_->active_requests_++;
+      p_->last_activity_ = absl::Now();
+    }
+
+    ~ScopedRequest() {
+      absl::MutexLock lock(&p_->mu_);
+      p_->active_requests_--;
+      p_->last_activity_ = absl::Now();
+    }
+
+   private:
+    ProjectServer* const p_;
+  };
+
+  // Completion queue tag: runs a callback with the outcome of the operation
+  // it was handed to.
+  class Tag {
+   public:
+    explicit Tag(std::function<void(bool ok)> done) : done_(std::move(done)) {}
+    void Complete(bool ok) { done_(ok); }
+
+   private:
+    const std::function<void(bool ok)> done_;
+  };
+
+  void Poll() {
+    void* tag;
+    bool ok;
+    while (cq_->Next(&tag, &ok)) {
+      static_cast<Tag*>(tag)->Complete(ok);
+    }
+  }
+
+  // A unary call: one is always waiting for the next request of its method.
+  // Handlers run on a polling thread and must not block.
+  template <class Request, class Response>
+  class UnaryCall {
+   public:
+    typedef void (ProjectService::AsyncService::*RequestFn)(
+        grpc::ServerContext*, Request*,
+        grpc::ServerAsyncResponseWriter<Response>*, grpc::CompletionQueue*,
+        grpc::ServerCompletionQueue*, void*);
+    typedef grpc::Status (ProjectServer::*HandlerFn)(const Request&,
+                                                     Response*);
+
+    static void Await(ProjectServer* p, RequestFn request, HandlerFn handler) {
+      new UnaryCall(p, request, handler);
+    }
+
+   private:
+    UnaryCall(ProjectServer* p, RequestFn request, HandlerFn handler)
+        : p_(p),
+          request_fn_(request),
+          handler_(handler),
+          responder_(&ctx_),
+          arrived_([this](bool ok) { Arrived(ok); }),
+          finished_([this](bool ok) { delete this; }) {
+      (p_->service_.*request_fn_)(&ctx_, &request_, &responder_, p_->cq_.get(),
+                                  p_->cq_.get(), &arrived_);
+    }
+
+    void Arrived(bool ok) {
+      if (!ok) {
+        // shutting down
+        delete this;
+        return;
+      }
+      Await(p_, request_fn_, handler_);
+      Response response;
+      grpc::Status status;
+      {
+        ScopedRequest scoped_request(p_);
+        status = (p_->*handler_)(request_, &response);
+      }
+      responder_.Finish(response, status, &finished_);
+    }
+
+    ProjectServer* const p_;
+    const RequestFn request_fn_;
+    const HandlerFn handler_;
+    grpc::ServerContext ctx_;
+    Request request_;
+    grpc::ServerAsyncResponseWriter<Response> responder_;
+    Tag arrived_;
+    Tag finished_;
+  };
+
+  // One Edit stream. Its reads and writes are completion queue operations,
+  // so a session that is waiting on its client ties up no thread. Work that
+  // may block is handed to the server's session_work_ threads: applying the
+  // commands read (the next read waits for that, so they're applied in
+  // order), attaching to the buffer (which loads it and sends its initial
+  // state), and detaching from it once the client is gone. Buffer updates
+  // are queued from the listener's delivery thread, which never waits for
+  // the client: one too far behind is cancelled. A same-host client may
+  // instead exchange messages through shared memory, read here by a thread
+  // of the session's own.
+  class EditSession {
+   public:
+    static void Await(ProjectServer* p) { new EditSession(p); }
+
+   private:
+    explicit EditSession(ProjectServer* p)
+        : p_(p),
+          stream_(&ctx_),
+          arrived_([this](bool ok) { Arrived(ok); }),
+          read_([this](bool ok) { ReadDone(ok); }),
+          written_([this](bool ok) { WriteDone(ok); }),
+          finished_([this](bool ok) { Unref(); }),
+          done_([this](bool ok) { Unref(); }) {
+      ctx_.AsyncNotifyWhenDone(&done_);
+      p_->service_.RequestRawEdit(&ctx_, &stream_, p_->cq_.get(),
+                                  p_->cq_.get(), &arrived_);
+    }
+
+    void Arrived(bool ok) {
+      if (!ok) {
+        // shutting down: the call never started, so done_ won't fire either
+        delete this;
+        return;
+      }
+      Await(p_);
+      scoped_request_.reset(new ScopedRequest(p_));
+      absl::MutexLock lock(&mu_);
+      // done_ (now that the call has started) and the greeting's read
+      refs_ = 2;
+      stream_.Read(&in_, &read_);
+    }
+
+    void ReadDone(bool ok) {
+      if (ok && greeted_ && in_.type_case() == EditMessage::kCommands) {
+        // the read's reference passes to the push
+        p_->session_work_.Schedule([this]() { PushCommands(); });
+        return;
+      }
+      {
+        absl::MutexLock lock(&mu_);
+        if (!ok) {
+          Close(greeted_ ? grpc::Status::OK
+                         : grpc::Status(grpc::INVALID_ARGUMENT,
+                                        "Stream closed with no greeting"));
+        } else if (greeted_) {
+          Close(grpc::Status(grpc::INVALID_ARGUMENT,
+                             "Expected commands after greetings"));
+        } else if (in_.type_case() != EditMessage::kClientHello) {
+          Close(grpc::Status(grpc::INVALID_ARGUMENT,
+                             "First message from client must be ClientHello"));
+        } else {
+          greeted_ = true;
+          refs_++;
+          p_->session_work_.Schedule(
+              [this, hello = in_.client_hello()]() { Attach(hello); });
+        }
+      }
+      Unref();
+    }
+
+    // apply the commands just read, then read the next
+    void PushCommands() {
+      buffer_->PushChanges(&in_.commands(), true, site_->site_id());
+      {
+        absl::MutexLock lock(&mu_);
+        refs_++;
+        stream_.Read(&in_, &read_);
+      }
+      Unref();
+    }
+
+    void Attach(const EditMessage::ClientHello& hello) {
+      grpc::Status status = Listen(hello);
+      {
+        absl::MutexLock lock(&mu_);
+        if (status.ok()) {
+          // commands are only read once the client has been greeted; over
+          // shared memory, the stream's read just waits for the session to
+          // end
+          if (shm_) {
+            shm_reader_ = std::thread([this]() { ReadSharedMemory(); });
+          }
+          refs_++;
+          stream_.Read(&in_, &read_);
+        } else {
+          Close(status);
+        }
+      }
+      Unref();
+    }
+
+    grpc::Status Listen(const EditMessage::ClientHello& hello) {
+      path_ = boost::filesystem::absolute(hello.buffer_name());
+      buffer_ = p_->GetBuffer(path_);
+      if (!buffer_) {
+        return grpc::Status(grpc::INVALID_ARGUMENT,
+                            "Unable to access requested buffer");
+      }
+      initial_state_ = p_->InitialStateFor(path_);
+      const bool resuming = hello.has_resume();
+      const auto& resume = hello.resume();
+      if (resuming && resume.epoch() != buffer_->epoch()) {
+        // the buffer was reloaded since: its history (and ids) differ
+        return grpc::Status(grpc::FAILED_PRECONDITION,
+                            "Edit session can no longer be resumed");
+      }
+      site_.reset(new Site(resuming ? absl::optional<int>(resume.site_id())
+                                    : absl::optional<int>()));
+      if (hello.has_shared_memory()) {
+        const auto& offer = hello.shared_memory();
+        shm_ = SharedMemoryChannel::Open(offer.pid(), offer.fd(),
+                                         offer.ring_bytes(), offer.token());
+      }
+      p_->StartSession(path_, site_->site_id());
+      const VersionVector since = VersionVectorFromProto(resume.version());
+      listener_ = buffer_->ListenVersioned(
+          resuming ? &since : nullptr,
+          [this](const AnnotatedString& content, const CommandSet* missed,
+                 const VersionVector& version) {
+            EditMessage out;
+            auto body = out.mutable_server_hello();
+            body->set_site_id(site_->site_id());
+            body->set_epoch(buffer_->epoch());
+            if (missed) *body->mutable_missed() = *missed;
+            *body->mutable_version() = VersionVectorToProto(version);
+            body->set_shared_memory(shm_ != nullptr);
+            SendOnStream(EditMessageBuffer(&out), false);
+            if (missed) return;
+            // new sessions (and resumed ones we lack the history for) get
+            // the whole state as bounded commands messages, top of the
+            // document first: the client can show it before the transfer
+            // completes. A resumed client already holds some of it, and may
+            // hold only the start of a run sent here as one insert:
+            // integrating skips just the characters it has
+            initial_state_->ForEachChunk(
+                content, [&](const std::shared_ptr<const std::string>& chunk) {
+                  Send(EditMessageBuffer(chunk, version), false);
+                });
+          },
+          [this](const PublishedUpdates& updates,
+                 const VersionVector& version) {
+            // each update was serialized once, for every stream it goes to
+            Send(EditMessageBuffer(updates, version), true);
+          },
+          [this]() {
+            Log() << "Edit stream fell too far behind; cancelling";
+            ctx_.TryCancel();
+          });
+      return grpc::Status::OK;
+    }
+
+    // send msg by whichever transport the session uses; dropped if the
+    // session is closing. bounded is as for SendOnStream: shared memory is
+    // bounded by its ring instead, and waits for room until the session is
+    // closed (as it is once its listener disconnects)
+    void Send(grpc::ByteBuffer msg, bool bounded) {
+      if (!shm_) {
+        SendOnStream(std::move(msg), bounded);
+        return;
+      }
+      // the slices are copied straight into the ring
+      std::vector<grpc::Slice> slices;
+      msg.Dump(&slices);
+      std::vector<absl::string_view> pieces;
+      for (const auto& slice : slices) {
+        pieces.emplace_back(reinterpret_cast<const char*>(slice.begin()),
+                            slice.size());
+      }
+      shm_->Write(pieces);
+    }
+
+    // commands from a client using shared memory
+    void ReadSharedMemory() {
+      std::string frame;
+      EditMessage msg;
+      while (shm_->Read(&frame)) {
+        if (!msg.ParseFromString(frame) ||
+            msg.type_case() != EditMessage::kCommands) {
+          Log() << "Malformed shared memory frame; cancelling";
+          ctx_.TryCancel();
+          return;
+        }
+        buffer_->PushChanges(&msg.commands(), true, site_->site_id());
+      }
+    }
+
+    // queue msg for the stream. Bounded messages (buffer updates) count
+    // against the outbox limit, and one that finds it reached cancels the
+    // call: the client has fallen too far behind to catch up, and waiting
+    // for it would hold a delivery thread. The initial state is as big as
+    // the document, and is queued whole
+    void SendOnStream(grpc::ByteBuffer msg, bool bounded) {
+      absl::MutexLock lock(&mu_);
+      if (closed_) return;
+      if (bounded && outbox_bytes_ >=
+                         static_cast<size_t>(FLAGS_edit_max_outbox_bytes)) {
+        Log() << "Edit stream outbox full; cancelling";
+        // reads fail once the call is cancelled, which closes the session
+        closed_ = true;
+        ctx_.TryCancel();
+        return;
+      }
+      const size_t bytes = bounded ? msg.Length() : 0;
+      outbox_bytes_ += bytes;
+      outbox_.push_back(Outgoing{std::move(msg), bytes});
+      if (!writing_) WriteFront();
+    }
+
+    void WriteFront() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      writing_ = true;
+      refs_++;
+      stream_.Write(outbox_.front().msg, &written_);
+    }
+
+    void WriteDone(bool ok) {
+      {
+        absl::MutexLock lock(&mu_);
+        writing_ = false;
+        outbox_bytes_ -= outbox_.front().bounded_bytes;
+        outbox_.pop_front();
+        // a failed write means the call is over: its reads fail too, and
+        // that closes the session
+        if (ok && !outbox_.empty()) {
+          WriteFront();
+        } else {
+          MaybeFinish();
+        }
+      }
+      Unref();
+    }
+
+    // stop sending, and finish the call with status once detached from the
+    // buffer
+    void Close(grpc::Status status) EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      closed_ = true;
+      if (shm_) shm_->Close();
+      // the client is leaving: drop everything but the write in flight
+      while (outbox_.size() > (writing_ ? 1 : 0)) {
+        outbox_bytes_ -= outbox_.back().bounded_bytes;
+        outbox_.pop_back();
+      }
+      if (!buffer_) {
+        finish_ = status;
+        MaybeFinish();
+        return;
+      }
+      refs_++;
+      p_->session_work_.Schedule([this, status]() { Detach(status); });
+    }
+
+    void Detach(const grpc::Status& status) {
+      listener_.reset();
+      if (shm_reader_.joinable()) shm_reader_.join();
+      {
+        absl::MutexLock lock(&mu_);
+        finish_ = status;
+        MaybeFinish();
+      }
+      if (!site_) {
+        buffer_.reset();
+        p_->ReleaseBuffer(path_);
+        Unref();
+        return;
+      }
+      // the buffer is held until the session is known to be over, or
+      // resumed: another stream may pick up the site's cursors and such
+      std::shared_ptr<Buffer> buffer = std::move(buffer_);
+      std::shared_ptr<Site> site = std::move(site_);
+      ProjectServer* p = p_;
+      const boost::filesystem::path path = path_;
+      p_->EndSession(path_, site->site_id(),
+                     [p, path, buffer, site](bool over) mutable {
+                       if (over) {
+                         CommandSet cleanup_commands;
+                         buffer->ContentSnapshot().MakeDeleteAttributesBySite(
+                             &cleanup_commands, *site);
+                         buffer->PushChanges(&cleanup_commands, false);
+                       }
+                       buffer.reset();
+                       p->ReleaseBuffer(path);
+                     });
+      Unref();
+    }
+
+    // only one write may be in flight, and finishing counts as one
+    void MaybeFinish() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      if (!finish_ || writing_ || finishing_) return;
+      finishing_ = true;
+      refs_++;
+      stream_.Finish(*finish_, &finished_);
+    }
+
+    // drop a reference held by a pending operation or helper thread; the
+    // last one deletes the session
+    void Unref() {
+      bool last;
+      {
+        absl::MutexLock lock(&mu_);
+        last = --refs_ == 0;
+      }
+      if (last) delete this;
+    }
+
+    ProjectServer* const p_;
+    grpc::ServerContext ctx_;
+    grpc::ServerAsyncReaderWriter<grpc::ByteBuffer, EditMessage> stream_;
+    std::unique_ptr<ScopedRequest> scoped_request_;
+    Tag arrived_;
+    Tag read_;
+    Tag written_;
+    Tag finished_;
+    Tag done_;
+    // only touched by read completions, which run one at a time
+    EditMessage in_;
+    bool greeted_ = false;
+    // set up by Attach before commands are read, torn down by Detach after
+    // the last read completes
+    boost::filesystem::path path_;
+    std::shared_ptr<Buffer> buffer_;
+    std::shared_ptr<InitialStateCache> initial_state_;
+    std::unique_ptr<Site> site_;
+    std::unique_ptr<BufferListener> listener_;
+    std::unique_ptr<SharedMemoryChannel> shm_;
+    std::thread shm_reader_;
+    absl::Mutex mu_;
+    int refs_ GUARDED_BY(mu_) = 0;
+    struct Outgoing {
+      grpc::ByteBuffer msg;
+      // what msg counts against the outbox limit
+      size_t bounded_bytes;
+    };
+    std::deque<Outgoing> outbox_ GUARDED_BY(mu_);
+    size_t outbox_bytes_ GUARDED_BY(mu_) = 0;
+    bool writing_ GUARDED_BY(mu_) = false;
+    bool closed_ GUARDED_BY(mu_) = false;
+    absl::optional<grpc::Status> finish_ GUARDED_BY(mu_);
+    bool finishing_ GUARDED_BY(mu_) = false;
+  };
+
+  const boost::filesystem::path ced_bin_;
   Project project_;
+  // outlives session_work_, which may still be evicting buffers into it
+  const SnapshotDir snapshots_;
+  Service service_;
+  std::unique_ptr<grpc::ServerCompletionQueue> cq_;
   std::unique_ptr<grpc::Server> server_;
+  std::vector<std::thread> polling_threads_;
 
   absl::Mutex mu_;
   int active_requests_ GUARDED_BY(mu_);
   absl::Time last_activity_ GUARDED_BY(mu_);
-  std::map<boost::filesystem::path, std::unique_ptr<Buffer>> buffers_
+  struct LoadedBuffer {
+    std::shared_ptr<Buffer> buffer;
+    std::shared_ptr<InitialStateCache> initial_state;
+    absl::Time last_access;
+  };
+  std::map<boost::filesystem::path, LoadedBuffer> buffers_ GUARDED_BY(mu_);
+  // buffers being shut down and written to disk: GetBuffer must wait for
+  // their snapshot before reloading them
+  std::set<boost::filesystem::path> evicting_ GUARDED_BY(mu_);
+  struct Session {
+    int streams = 0;
+    // when streams last fell to zero
+    absl::Time ended;
+  };
+  // streams attached to each (buffer, site) edit session
+  std::map<std::pair<boost::filesystem::path, int>, Session> sessions_
       GUARDED_BY(mu_);
   bool quit_requested_ GUARDED_BY(mu_);
+  bool standby_spawned_ GUARDED_BY(mu_) = false;
+  // while it's running
+  pid_t standby_pid_ GUARDED_BY(mu_) = 0;
+  // an EvictIdleBuffers is waiting to run on session_work_
+  bool eviction_scheduled_ GUARDED_BY(mu_) = false;
+  // see EditSession: sessions are over by the time Run returns, but an
+  // eviction may still be due. Declared last so that it's drained before
+  // anything it uses is destroyed
+  Executor session_work_{"session_work", FLAGS_server_session_threads};
 
   static bool IsChildOf(boost::filesystem::path needle,
                         boost::filesystem::path haystack) {
@@ -155,45 +922,211 @@ class ProjectServer : public Application, public ProjectService::Service {
                       needle_str.begin());
   }
 
-  Buffer* GetBuffer(boost::filesystem::path path) {
+  std::shared_ptr<Buffer> GetBuffer(boost::filesystem::path path) {
     path = boost::filesystem::absolute(path);
     if (!IsChildOf(path, project_.aspect<ProjectRoot>()->Path())) {
       Log() << "Attempt to access outside of project sandbox: " << path
             << " in project root " << project_.aspect<ProjectRoot>()->Path();
       return nullptr;
     }
+    std::shared_ptr<Buffer> buffer;
+    {
+      absl::MutexLock lock(&mu_);
+      auto not_evicting = [this, &path]() {
+        mu_.AssertHeld();
+        return evicting_.count(path) == 0;
+      };
+      mu_.Await(absl::Condition(&not_evicting));
+      auto it = buffers_.find(path);
+      if (it != buffers_.end()) {
+        it->second.last_access = absl::Now();
+        return it->second.buffer;
+      }
+      if (!boost::filesystem::exists(path)) {
+        return nullptr;
+      }
+      Buffer::Builder builder;
+      builder.SetFilename(path).SetProject(&project_);
+      RestoreSnapshot(path, &builder);
+      buffer = builder.Make();
+      buffers_.emplace(path,
+                       LoadedBuffer{buffer,
+                                    std::make_shared<InitialStateCache>(),
+                                    absl::Now()});
+      ScheduleEviction();
+    }
+    return buffer;
+  }
+
+  std::shared_ptr<InitialStateCache> InitialStateFor(
+      const boost::filesystem::path& path) {
     absl::MutexLock lock(&mu_);
     auto it = buffers_.find(path);
-    if (it != buffers_.end()) {
-      return it->second.get();
+    // already evicted: nobody else can attach to this instance anyway
+    if (it == buffers_.end()) return std::make_shared<InitialStateCache>();
+    return it->second.initial_state;
+  }
+
+  void StartSession(const boost::filesystem::path& path, int site_id) {
+    absl::MutexLock lock(&mu_);
+    sessions_[std::make_pair(path, site_id)].streams++;
+  }
+
+  // called as a stream of a session ends: then(true) runs once the session
+  // is over, its last stream having ended and no other resumed it within
+  // the grace period, and then(false) otherwise. Nothing waits for the
+  // grace period: then runs on session_work_ when it's up
+  void EndSession(const boost::filesystem::path& path, int site_id,
+                  std::function<void(bool over)> then) {
+    const auto key = std::make_pair(path, site_id);
+    const absl::Time now = absl::Now();
+    bool streams_left;
+    {
+      absl::MutexLock lock(&mu_);
+      Session& session = sessions_[key];
+      streams_left = --session.streams > 0;
+      if (!streams_left) session.ended = now;
     }
-    if (!boost::filesystem::exists(path)) {
-      return nullptr;
+    if (streams_left) {
+      then(false);
+      return;
     }
-    return buffers_
-        .emplace(
-            path,
-            Buffer::Builder().SetFilename(path).SetProject(&project_).Make())
-        .first->second.get();
+    session_work_.ScheduleAt(
+        now + absl::Milliseconds(FLAGS_edit_resume_grace_ms),
+        [this, key, now, then]() {
+          bool over = false;
+          {
+            absl::MutexLock lock(&mu_);
+            auto it = sessions_.find(key);
+            // resumed since, and maybe ended again: then the later end
+            // decides
+            if (it != sessions_.end() && it->second.streams == 0 &&
+                it->second.ended == now) {
+              sessions_.erase(it);
+              over = true;
+            }
+          }
+          then(over);
+        });
   }
 
-  class ScopedRequest {
-   public:
-    explicit ScopedRequest(ProjectServer* p) : p_(p) {
-      absl::MutexLock lock(&p_->mu_);
-      p_->active_requests_++;
-      p_->last_activity_ = absl::Now();
+  // called when a request stops using a buffer
+  void ReleaseBuffer(const boost::filesystem::path& path) {
+    absl::MutexLock lock(&mu_);
+    auto it = buffers_.find(path);
+    if (it != buffers_.end()) it->second.last_access = absl::Now();
+    ScheduleEviction();
+  }
+
+  // evicting shuts buffers down and writes them out, which takes a while:
+  // the session that got or released a buffer shouldn't wait for that
+  void ScheduleEviction() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (eviction_scheduled_) return;
+    eviction_scheduled_ = true;
+    session_work_.Schedule([this]() {
+      {
+        absl::MutexLock lock(&mu_);
+        eviction_scheduled_ = false;
+      }
+      EvictIdleBuffers();
+    });
+  }
+
+  // evict least recently used buffers that nobody is using until we're back
+  // under budget
+  void EvictIdleBuffers() {
+    std::vector<std::pair<boost::filesystem::path, std::shared_ptr<Buffer>>>
+        evicted;
+    {
+      absl::MutexLock lock(&mu_);
+      size_t memory = 0;
+      std::map<boost::filesystem::path, size_t> memory_by_buffer;
+      std::vector<std::pair<absl::Time, boost::filesystem::path>> idle;
+      for (const auto& b : buffers_) {
+        const size_t usage = b.second.buffer->ApproximateMemoryUsage() +
+                             b.second.initial_state->bytes();
+        memory += usage;
+        memory_by_buffer[b.first] = usage;
+        // references are only taken under mu_, so a count of one means no
+        // request is between GetBuffer and Listen either
+        if (b.second.buffer.use_count() == 1 &&
+            !b.second.buffer->HasListeners()) {
+          idle.emplace_back(b.second.last_access, b.first);
+        }
+      }
+      std::sort(idle.begin(), idle.end());
+      const size_t max_memory =
+          static_cast<size_t>(FLAGS_server_max_buffer_memory_mb) << 20;
+      for (const auto& candidate : idle) {
+        if (buffers_.size() <= static_cast<size_t>(FLAGS_server_max_buffers) &&
+            memory <= max_memory) {
+          break;
+        }
+        auto it = buffers_.find(candidate.second);
+        memory -= memory_by_buffer[candidate.second];
+        evicted.emplace_back(it->first, std::move(it->second.buffer));
+        evicting_.insert(it->first);
+        buffers_.erase(it);
+      }
+    }
+    for (auto& e : evicted) {
+      Log() << "Evicting idle buffer " << e.first;
+      // collaborators save the file and may edit right up until they stop:
+      // the snapshot must come after
+      e.second->Close();
+      AnnotatedStringMsg content = e.second->ContentSnapshot().AsProto();
+      e.second.reset();
+      WriteSnapshot(e.first, &content);
+      absl::MutexLock lock(&mu_);
+      evicting_.erase(e.first);
     }
+  }
 
-    ~ScopedRequest() {
-      absl::MutexLock lock(&p_->mu_);
-      p_->active_requests_--;
-      p_->last_activity_ = absl::Now();
+  boost::filesystem::path SnapshotPath(const boost::filesystem::path& path) {
+    return snapshots_.path() /
+           absl::StrCat(std::hash<std::string>()(path.string()), ".snapshot");
+  }
+
+  static int64_t ModificationTime(const boost::filesystem::path& path) {
+    struct stat st;
+    if (stat(path.string().c_str(), &st) != 0) return -1;
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+           st.st_mtim.tv_nsec;
+  }
+
+  void WriteSnapshot(const boost::filesystem::path& path,
+                     AnnotatedStringMsg* content) {
+    BufferSnapshot snapshot;
+    snapshot.set_filename(path.string());
+    snapshot.set_mtime(ModificationTime(path));
+    content->clear_attributes();
+    content->clear_annotations();
+    content->clear_graveyard();
+    snapshot.mutable_content()->Swap(content);
+    std::ofstream out(SnapshotPath(path).string(), std::ios::binary);
+    if (!snapshot.SerializeToOstream(&out)) {
+      Log() << "Failed writing snapshot for " << path;
     }
+  }
 
-   private:
-    ProjectServer* const p_;
-  };
+  void RestoreSnapshot(const boost::filesystem::path& path,
+                       Buffer::Builder* builder) {
+    const auto snapshot_path = SnapshotPath(path);
+    BufferSnapshot snapshot;
+    {
+      std::ifstream in(snapshot_path.string(), std::ios::binary);
+      if (!in || !snapshot.ParseFromIstream(&in)) return;
+    }
+    boost::filesystem::remove(snapshot_path);
+    if (snapshot.filename() != path.string()) return;
+    if (snapshot.mtime() != ModificationTime(path)) {
+      Log() << "Discarding stale snapshot for " << path;
+      return;
+    }
+    Log() << "Restoring " << path << " from snapshot";
+    builder->SetInitialString(AnnotatedString::FromProto(snapshot.content()))
+        .SetFullyLoaded();
+  }
 
   static boost::filesystem::path PathFromArgs(int argc, char** argv) {
     if (argc != 2) throw std::runtime_error("Expected path");
@@ -203,17 +1136,34 @@ class ProjectServer : public Application, public ProjectService::Service {
 
 REGISTER_APPLICATION(ProjectServer);
 
-void SpawnServer(const boost::filesystem::path& ced_bin,
+bool SpawnServer(const boost::filesystem::path& ced_bin,
                  const Project& project) {
-  run_daemon(
-      ced_bin,
-      {
-          "-mode",
-          "ProjectServer",
-          "-logfile",
-          (project.aspect<ProjectRoot>()->LocalAddressPath().parent_path() /
-           absl::StrCat(".cedlog.server.", ced_src_hash))
-              .string(),
-          project.aspect<ProjectRoot>()->LocalAddressPath().string(),
-      });
+  int ready[2];
+  WrapSyscall("pipe", [&]() { return pipe(ready); });
+  for (int fd : ready) {
+    WrapSyscall("fcntl", [&]() { return fcntl(fd, F_SETFD, FD_CLOEXEC); });
+  }
+  std::vector<std::string> flags{"-server_ready_fd", "3"};
+  if (FLAGS_server_standby) flags.push_back("-server_standby");
+  const pid_t pid =
+      run_daemon(ced_bin, ServerArgs(project, "server", flags), ready[1]);
+  close(ready[1]);
+  // the server writes a byte once it's listening: should it exit first, the
+  // pipe closes empty
+  pollfd pfd = {ready[0], POLLIN, 0};
+  char byte;
+  const bool started =
+      WrapSyscall("poll",
+                  [&]() {
+                    return poll(&pfd, 1, FLAGS_server_start_timeout_ms);
+                  }) == 1 &&
+      WrapSyscall("read", [&]() { return read(ready[0], &byte, 1); }) == 1;
+  close(ready[0]);
+  if (!started) {
+    Log() << "Server failed to start";
+    // one still starting is given up on: the caller carries on without it
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+  }
+  return started;
 }
@@ -15,5 +15,7 @@
 
 #include "project.h"
 
-void SpawnServer(const boost::filesystem::path& ced_bin,
+// starts a project server, and waits until it accepts connections: false if
+// it exited (or timed out) first
+bool SpawnServer(const boost::filesystem::path& ced_bin,
                  const Project& project);
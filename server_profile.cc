@@ -0,0 +1,75 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <iostream>
+#include "application.h"
+#include "client.h"
+#include "histogram.h"
+
+// Dumps the collaborator latency histograms held by the project server
+class ServerProfile : public Application {
+ public:
+  ServerProfile(int argc, char** argv)
+      : path_(PathFromCmdLine(argc, argv)), client_(argv[0], path_) {}
+
+  int Run() override {
+    ProfileResponse rsp = client_.Profile(
+        boost::filesystem::is_directory(path_) ? boost::filesystem::path()
+                                               : path_);
+    auto print = [](const std::string& prefix,
+                    const CollaboratorProfile& c) {
+      auto line = [&](const char* name, const HistogramMsg& h) {
+        if (h.count() == 0) return;
+        std::cout << prefix << c.name() << ":" << name << ": "
+                  << HistogramSummary(h) << "\n";
+      };
+      line("queue_us", c.queue_delay_us());
+      line("exec_us", c.execution_us());
+      line("pull_us", c.pull_us());
+      line("integrate_us", c.integration_us());
+      line("rsp_bytes", c.response_bytes());
+    };
+    for (const auto& b : rsp.buffers()) {
+      for (const auto& c : b.collaborators()) {
+        print(b.filename() + ":", c);
+      }
+      if (b.listener_traffic().messages_in() != 0) {
+        std::cout << b.filename() << ":listeners: " << ListenerTrafficSummary(b)
+                  << "\n";
+      }
+    }
+    for (const auto& c : rsp.project()) {
+      print("project:", c);
+    }
+    const auto& process = rsp.process();
+    std::cout << "process: user_cpu_us=" << process.user_cpu_us()
+              << " system_cpu_us=" << process.system_cpu_us()
+              << " max_rss_bytes=" << process.max_rss_bytes()
+              << " buffer_bytes=" << process.buffer_bytes() << "\n";
+    return 0;
+  }
+
+ private:
+  const boost::filesystem::path path_;
+  Client client_;
+
+  static boost::filesystem::path PathFromCmdLine(int argc, char** argv) {
+    if (argc != 2) {
+      throw std::runtime_error("Expected a project directory or filename");
+    }
+    return argv[1];
+  }
+};
+
+REGISTER_APPLICATION(ServerProfile);
@@ -0,0 +1,355 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "shm_channel.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <random>
+#include "absl/strings/str_cat.h"
+#include "log.h"
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+// a blocked side rechecks for a closed channel at least this often, in case
+// its peer died without closing it
+constexpr int kWaitTimeoutMs = 100;
+// how many times to look for progress before sleeping: a peer that is
+// keeping up answers well within a syscall's round trip
+constexpr int kSpins = 256;
+constexpr size_t kHeaderBytes = 4096;
+// frame lengths are written by the peer: a larger one means it's broken
+constexpr uint32_t kMaxFrameBytes = 64 << 20;
+#ifdef __linux__
+constexpr char kMemfdName[] = "ced-edit";
+// fixed in size for good: neither end can fault the other by truncating it
+constexpr int kSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#endif
+
+void FutexWait(std::atomic<uint32_t>* word, uint32_t expected) {
+#ifdef __linux__
+  struct timespec timeout = {0, kWaitTimeoutMs * 1000000L};
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected,
+          &timeout, nullptr, 0);
+#endif
+}
+
+void FutexWake(std::atomic<uint32_t>* word) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX,
+          nullptr, nullptr, 0);
+#endif
+}
+
+}  // namespace
+
+// Shared by both processes, at the start of the mapping. Counters only ever
+// grow: a ring's fill is written - read.
+struct SharedMemoryChannel::Header {
+  struct alignas(64) RingState {
+    std::atomic<uint64_t> written;
+    std::atomic<uint64_t> read;
+    // futex words, bumped whenever written (read) advances
+    std::atomic<uint32_t> written_seq;
+    std::atomic<uint32_t> read_seq;
+    // set while the reader (writer) is, or is about to be, asleep
+    std::atomic<uint32_t> reader_waiting;
+    std::atomic<uint32_t> writer_waiting;
+  };
+  std::atomic<uint32_t> closed;
+  // chosen by the creator, and sent alongside the descriptor: the end that
+  // opens the channel checks it's the one offered
+  uint64_t token;
+  // [0] carries creator -> peer, [1] peer -> creator
+  RingState rings[2];
+};
+
+// One direction of the channel, as seen from one end.
+class SharedMemoryChannel::Ring {
+ public:
+  Ring(Header* header, Header::RingState* state, char* data, size_t size)
+      : header_(header), state_(state), data_(data), size_(size) {}
+
+  bool Put(const char* p, size_t n) {
+    while (n > 0) {
+      const uint64_t written = state_->written.load(std::memory_order_relaxed);
+      size_t room = 0;
+      auto has_room = [&]() {
+        room = size_ - (written - state_->read.load(std::memory_order_acquire));
+        return room > 0;
+      };
+      if (!Await(has_room, &state_->read_seq, &state_->writer_waiting)) {
+        return false;
+      }
+      // the counters are the peer's to write too
+      if (room > size_) {
+        Log() << "Shared memory ring counters are inconsistent";
+        return false;
+      }
+      const size_t chunk = std::min(n, room);
+      const size_t offset = written % size_;
+      const size_t first = std::min(chunk, size_ - offset);
+      memcpy(data_ + offset, p, first);
+      memcpy(data_, p + first, chunk - first);
+      state_->written.store(written + chunk, std::memory_order_release);
+      Advanced(&state_->written_seq, &state_->reader_waiting);
+      p += chunk;
+      n -= chunk;
+    }
+    return true;
+  }
+
+  bool Get(char* p, size_t n) {
+    while (n > 0) {
+      const uint64_t read = state_->read.load(std::memory_order_relaxed);
+      size_t available = 0;
+      auto has_data = [&]() {
+        available = state_->written.load(std::memory_order_acquire) - read;
+        return available > 0;
+      };
+      if (!Await(has_data, &state_->written_seq, &state_->reader_waiting)) {
+        return false;
+      }
+      if (available > size_) {
+        Log() << "Shared memory ring counters are inconsistent";
+        return false;
+      }
+      const size_t chunk = std::min(n, available);
+      const size_t offset = read % size_;
+      const size_t first = std::min(chunk, size_ - offset);
+      memcpy(p, data_ + offset, first);
+      memcpy(p + first, data_, chunk - first);
+      state_->read.store(read + chunk, std::memory_order_release);
+      Advanced(&state_->read_seq, &state_->writer_waiting);
+      p += chunk;
+      n -= chunk;
+    }
+    return true;
+  }
+
+  void Wake() {
+    state_->written_seq.fetch_add(1);
+    state_->read_seq.fetch_add(1);
+    FutexWake(&state_->written_seq);
+    FutexWake(&state_->read_seq);
+  }
+
+ private:
+  // wait for ready() (which the peer signals by bumping seq), unless the
+  // channel is closed first
+  template <class F>
+  bool Await(F ready, std::atomic<uint32_t>* seq,
+             std::atomic<uint32_t>* waiting) {
+    for (int i = 0; i < kSpins; i++) {
+      if (ready()) return true;
+    }
+    for (;;) {
+      if (header_->closed.load(std::memory_order_acquire)) return false;
+      // announce we may sleep before the final check: a peer advancing
+      // after it sees the announcement and wakes us
+      waiting->store(1);
+      const uint32_t observed = seq->load();
+      if (ready()) {
+        waiting->store(0);
+        return true;
+      }
+      FutexWait(seq, observed);
+      waiting->store(0);
+      if (ready()) return true;
+    }
+  }
+
+  static void Advanced(std::atomic<uint32_t>* seq,
+                       std::atomic<uint32_t>* waiting) {
+    seq->fetch_add(1);
+    if (waiting->load()) FutexWake(seq);
+  }
+
+  Header* const header_;
+  Header::RingState* const state_;
+  char* const data_;
+  const size_t size_;
+};
+
+SharedMemoryChannel::SharedMemoryChannel(int fd, void* mapping,
+                                         size_t ring_bytes, bool creator)
+    : fd_(fd),
+      token_(static_cast<Header*>(mapping)->token),
+      mapping_(mapping),
+      ring_bytes_(ring_bytes),
+      header_(static_cast<Header*>(mapping)) {
+  static_assert(sizeof(Header) <= kHeaderBytes,
+                "channel header overflows its page");
+  char* data = static_cast<char*>(mapping) + kHeaderBytes;
+  Ring* creator_to_peer =
+      new Ring(header_, &header_->rings[0], data, ring_bytes);
+  Ring* peer_to_creator =
+      new Ring(header_, &header_->rings[1], data + ring_bytes, ring_bytes);
+  out_.reset(creator ? creator_to_peer : peer_to_creator);
+  in_.reset(creator ? peer_to_creator : creator_to_peer);
+}
+
+SharedMemoryChannel::~SharedMemoryChannel() {
+  CloseFd();
+  munmap(mapping_, kHeaderBytes + 2 * ring_bytes_);
+}
+
+std::unique_ptr<SharedMemoryChannel> SharedMemoryChannel::Create(
+    size_t ring_bytes) {
+#ifdef __linux__
+  const int fd =
+      syscall(SYS_memfd_create, kMemfdName, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    Log() << "memfd_create failed: " << strerror(errno);
+    return nullptr;
+  }
+  const size_t size = kHeaderBytes + 2 * ring_bytes;
+  // a fresh memfd reads as zeros: every counter starts at zero
+  if (ftruncate(fd, size) != 0 || fcntl(fd, F_ADD_SEALS, kSeals) != 0) {
+    Log() << "Sizing shared memory failed: " << strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+  void* mapping =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    Log() << "Mapping shared memory failed: " << strerror(errno);
+    close(fd);
+    return nullptr;
+  }
+  std::random_device random;
+  static_cast<Header*>(mapping)->token =
+      (static_cast<uint64_t>(random()) << 32) | random();
+  return std::unique_ptr<SharedMemoryChannel>(
+      new SharedMemoryChannel(fd, mapping, ring_bytes, true));
+#else
+  return nullptr;
+#endif
+}
+
+std::unique_ptr<SharedMemoryChannel> SharedMemoryChannel::Open(
+    pid_t pid, int fd, size_t ring_bytes, uint64_t token) {
+#ifdef __linux__
+  // pid and fd come from the peer: before writing anything through the
+  // mapping, make sure it names a channel of ours (a sealed memfd of our
+  // name, rather than some file the descriptor happens to be), and the very
+  // one offered (it holds the token)
+  const std::string path = absl::StrCat("/proc/", pid, "/fd/", fd);
+  const int own_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (own_fd < 0) {
+    Log() << "Opening shared memory " << path << " failed: " << strerror(errno);
+    return nullptr;
+  }
+  auto fail = [&](const std::string& why) {
+    Log() << "Shared memory " << path << " " << why;
+    close(own_fd);
+    return nullptr;
+  };
+  char link[PATH_MAX];
+  const std::string own_path = absl::StrCat("/proc/self/fd/", own_fd);
+  const ssize_t link_length = readlink(own_path.c_str(), link, sizeof(link));
+  if (link_length < 0 ||
+      absl::string_view(link, link_length) !=
+          absl::StrCat("/memfd:", kMemfdName, " (deleted)")) {
+    return fail("isn't a channel");
+  }
+  if (fcntl(own_fd, F_GET_SEALS) != kSeals) return fail("isn't sealed");
+  const size_t size = kHeaderBytes + 2 * ring_bytes;
+  struct stat st;
+  if (ring_bytes == 0 || fstat(own_fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) != size) {
+    return fail(absl::StrCat("isn't ", size, " bytes"));
+  }
+  void* mapping =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, own_fd, 0);
+  close(own_fd);
+  if (mapping == MAP_FAILED) {
+    Log() << "Mapping shared memory failed: " << strerror(errno);
+    return nullptr;
+  }
+  if (static_cast<Header*>(mapping)->token != token) {
+    Log() << "Shared memory " << path << " isn't the channel offered";
+    munmap(mapping, size);
+    return nullptr;
+  }
+  return std::unique_ptr<SharedMemoryChannel>(
+      new SharedMemoryChannel(-1, mapping, ring_bytes, false));
+#else
+  return nullptr;
+#endif
+}
+
+void SharedMemoryChannel::CloseFd() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool SharedMemoryChannel::Write(const std::vector<absl::string_view>& pieces) {
+  size_t length = 0;
+  for (const auto& piece : pieces) length += piece.size();
+  if (length > kMaxFrameBytes) {
+    Log() << "Shared memory frame of " << length << " bytes is too large";
+    Close();
+    return false;
+  }
+  const uint32_t length32 = length;
+  absl::MutexLock lock(&write_mu_);
+  if (!out_->Put(reinterpret_cast<const char*>(&length32), sizeof(length32))) {
+    Close();
+    return false;
+  }
+  for (const auto& piece : pieces) {
+    if (!out_->Put(piece.data(), piece.size())) {
+      Close();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SharedMemoryChannel::Read(std::string* frame) {
+  absl::MutexLock lock(&read_mu_);
+  uint32_t length;
+  if (!in_->Get(reinterpret_cast<char*>(&length), sizeof(length))) {
+    Close();
+    return false;
+  }
+  if (length > kMaxFrameBytes) {
+    Log() << "Shared memory frame of " << length << " bytes is too large";
+    Close();
+    return false;
+  }
+  frame->resize(length);
+  if (!in_->Get(&(*frame)[0], length)) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void SharedMemoryChannel::Close() {
+  header_->closed.store(1, std::memory_order_release);
+  out_->Wake();
+  in_->Wake();
+}
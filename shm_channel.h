@@ -0,0 +1,79 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <sys/types.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+
+// Frames exchanged by two processes on one host through a memfd mapping
+// holding a single producer, single consumer byte ring per direction.
+// One end creates the mapping; the other opens it through the creator's
+// /proc/<pid>/fd entry, since gRPC can't carry file descriptors. Data is
+// never copied by the kernel: a reader or writer that has to wait sleeps on
+// a futex in the mapping, and is only woken if it's actually asleep.
+// Linux only: elsewhere Create and Open always fail.
+class SharedMemoryChannel {
+ public:
+  ~SharedMemoryChannel();
+  SharedMemoryChannel(const SharedMemoryChannel&) = delete;
+  SharedMemoryChannel& operator=(const SharedMemoryChannel&) = delete;
+
+  // the creating end, with ring_bytes in each direction; null on failure
+  static std::unique_ptr<SharedMemoryChannel> Create(size_t ring_bytes);
+  // the other end of a channel created by process pid, whose token is as
+  // given; null on failure (including if fd isn't such a channel)
+  static std::unique_ptr<SharedMemoryChannel> Open(pid_t pid, int fd,
+                                                   size_t ring_bytes,
+                                                   uint64_t token);
+
+  // the creator's descriptor for the mapping (-1 for the other end), to be
+  // opened by the peer: once it has, CloseFd may release it
+  int fd() const { return fd_; }
+  void CloseFd();
+  size_t ring_bytes() const { return ring_bytes_; }
+  // sent along with fd: see Open
+  uint64_t token() const { return token_; }
+
+  // send the concatenation of pieces as one frame, waiting for room as
+  // needed; false once the channel is closed. Frames are limited to 64MB:
+  // larger ones (sent or received), or ring counters the peer has broken,
+  // close the channel
+  bool Write(const std::vector<absl::string_view>& pieces);
+  // receive the next frame, waiting for it as needed; false once the
+  // channel is closed
+  bool Read(std::string* frame);
+  // fail every pending and future Read and Write, on both ends
+  void Close();
+
+ private:
+  struct Header;
+  class Ring;
+
+  SharedMemoryChannel(int fd, void* mapping, size_t ring_bytes, bool creator);
+
+  int fd_;
+  const uint64_t token_;
+  void* const mapping_;
+  const size_t ring_bytes_;
+  Header* const header_;
+  std::unique_ptr<Ring> out_;
+  std::unique_ptr<Ring> in_;
+  // a frame must be written (and read) without interleaving
+  absl::Mutex write_mu_;
+  absl::Mutex read_mu_;
+};
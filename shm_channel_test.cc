@@ -0,0 +1,95 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "shm_channel.h"
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <thread>
+
+TEST(SharedMemoryChannelTest, FramesCrossInBothDirections) {
+  auto creator = SharedMemoryChannel::Create(64);
+  ASSERT_NE(nullptr, creator);
+  auto peer =
+      SharedMemoryChannel::Open(getpid(), creator->fd(), creator->ring_bytes(),
+                                creator->token());
+  ASSERT_NE(nullptr, peer);
+  creator->CloseFd();
+
+  // larger than the ring, so it only fits through a concurrent reader
+  const std::string big(1000, 'x');
+  std::thread writer([&]() {
+    EXPECT_TRUE(creator->Write({"hello", " ", "world"}));
+    EXPECT_TRUE(creator->Write({}));
+    EXPECT_TRUE(creator->Write({big}));
+  });
+  std::string frame;
+  ASSERT_TRUE(peer->Read(&frame));
+  EXPECT_EQ("hello world", frame);
+  ASSERT_TRUE(peer->Read(&frame));
+  EXPECT_EQ("", frame);
+  ASSERT_TRUE(peer->Read(&frame));
+  EXPECT_EQ(big, frame);
+  writer.join();
+
+  EXPECT_TRUE(peer->Write({"reply"}));
+  ASSERT_TRUE(creator->Read(&frame));
+  EXPECT_EQ("reply", frame);
+}
+
+TEST(SharedMemoryChannelTest, CloseWakesBothEnds) {
+  auto creator = SharedMemoryChannel::Create(64);
+  ASSERT_NE(nullptr, creator);
+  auto peer =
+      SharedMemoryChannel::Open(getpid(), creator->fd(), creator->ring_bytes(),
+                                creator->token());
+  ASSERT_NE(nullptr, peer);
+  std::thread reader([&]() {
+    std::string frame;
+    EXPECT_FALSE(creator->Read(&frame));
+  });
+  std::thread writer([&]() {
+    // fills the ring, then waits for a reader that never comes
+    EXPECT_FALSE(creator->Write({std::string(1000, 'x')}));
+  });
+  usleep(10000);
+  peer->Close();
+  reader.join();
+  writer.join();
+  std::string frame;
+  EXPECT_FALSE(peer->Read(&frame));
+}
+
+TEST(SharedMemoryChannelTest, OpensOnlyTheChannelOffered) {
+  auto creator = SharedMemoryChannel::Create(64);
+  ASSERT_NE(nullptr, creator);
+  EXPECT_EQ(nullptr,
+            SharedMemoryChannel::Open(getpid(), creator->fd(),
+                                      creator->ring_bytes(),
+                                      creator->token() + 1));
+  // a descriptor for something else entirely
+  EXPECT_EQ(nullptr, SharedMemoryChannel::Open(getpid(), STDIN_FILENO,
+                                               creator->ring_bytes(),
+                                               creator->token()));
+}
+
+TEST(SharedMemoryChannelTest, OversizedFrameCloses) {
+  auto creator = SharedMemoryChannel::Create(64);
+  ASSERT_NE(nullptr, creator);
+  auto peer =
+      SharedMemoryChannel::Open(getpid(), creator->fd(), creator->ring_bytes(),
+                                creator->token());
+  ASSERT_NE(nullptr, peer);
+  EXPECT_FALSE(creator->Write({std::string((64 << 20) + 1, 'x')}));
+  std::string frame;
+  EXPECT_FALSE(peer->Read(&frame));
+}
@@ -122,6 +122,10 @@ CharFmt Theme::ThemeToken(Tag token, uint32_t flags) {
   if (flags & HIGHLIGHT_LINE) {
     background = Merge(composite.line_highlight, background);
   }
+  if (flags & FIND_MATCH) {
+    foreground = Merge(composite.find_highlight_foreground, foreground);
+    background = Merge(composite.find_highlight, background);
+  }
   if (flags & SELECTED) {
     background = Merge(composite.selection, background);
   }